@@ -16,8 +16,10 @@
 #include <string.h>
 #ifdef USE_TOD
 #include <sys/time.h>
-#else
+#endif
 #include <time.h>
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
 #endif
 #include "clock.h"
 
@@ -87,9 +89,14 @@ struct timeval new_time;
 struct timespec last_time;
 struct timespec new_time;
 
+#ifdef USE_WALL_CLOCK
+/* Use elapsed time, which counts the work of every thread */
+#define CLKT CLOCK_MONOTONIC
+#else
 /* Use thread clock */
 #define CLKT CLOCK_THREAD_CPUTIME_ID
 #endif
+#endif
 
 void start_timer()
 {
@@ -150,3 +157,38 @@ double get_counter()
     double delta_secs = get_timer();
     return delta_secs * cpu_mhz * 1e6;
 }
+
+/* Tick counter, for timing single calls too short for the timer */
+unsigned long long read_ticks()
+{
+#if defined(__x86_64__) || defined(__i386__)
+    return __rdtsc();
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (unsigned long long)now.tv_sec * 1000000000ULL +
+           (unsigned long long)now.tv_nsec;
+#endif
+}
+
+/* Calibrate the tick counter against elapsed time, once */
+double ticks_per_sec()
+{
+    static double rate = 0.0;
+    struct timespec start, now;
+    unsigned long long start_ticks;
+    double secs;
+
+    if (rate != 0.0)
+        return rate;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    start_ticks = read_ticks();
+    do
+    {
+        clock_gettime(CLOCK_MONOTONIC, &now);
+        secs = 1.0 * (now.tv_sec - start.tv_sec) +
+               1e-9 * (now.tv_nsec - start.tv_nsec);
+    } while (secs < 0.01);
+    rate = (double)(read_ticks() - start_ticks) / secs;
+    return rate;
+}
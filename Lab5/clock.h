@@ -20,3 +20,10 @@ void start_counter();
 
 /* Get # cycles since counter started.  Returns 1e20 if detect timing anomaly */
 double get_counter();
+
+/* Ticks: a constant-rate counter (the time stamp counter on x86) */
+/* Read the tick counter */
+unsigned long long read_ticks();
+
+/* Determine how many ticks there are per second */
+double ticks_per_sec();
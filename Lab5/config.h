@@ -151,7 +151,7 @@
 /*
  * Maximum target load for hash table
  */
-#define HASH_LOAD 10.0
+#define HASH_LOAD 2.0
 
 /***************** Parameters for looking up reference throughput *********/
 /*
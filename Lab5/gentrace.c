@@ -0,0 +1,594 @@
+/*
+ * gentrace.c - Synthesize malloc lab traces from parameterized workloads
+ *
+ * A workload is a sequence of phases, each given as one argument of
+ * comma-separated fields:
+ *
+ *   n=<count>        number of blocks allocated in the phase (required)
+ *   size=<mix>       size of each block, in bytes
+ *   life=<dist>      lifetime of each block, counted in later allocations,
+ *                    or "inf" for blocks that live until the trace ends
+ *   realloc=<f>:<k>:<growth>
+ *                    a fraction f of the blocks is reallocated k times,
+ *                    evenly over its lifetime, each time growing by
+ *                    g<factor> (multiplying) or a<bytes> (adding);
+ *                    realloc=0 turns reallocation off
+ *   free=<f>         on entering the phase, free a fraction f of the
+ *                    blocks still live from earlier phases
+ *
+ * A distribution <dist> is one of
+ *
+ *   c:<v>            constant v
+ *   u:<lo>:<hi>      uniform over [lo, hi]
+ *   e:<mean>         exponential
+ *   l:<median>:<s>   lognormal, with standard deviation s of the log
+ *   p:<min>:<alpha>  Pareto (power law) with shape alpha
+ *
+ * and a mixture <mix> joins distributions with '+', each optionally
+ * prefixed by its weight: "0.9*l:48:0.7+0.1*p:4096:1.2".  Apart from n
+ * and free, fields left out keep their value from the previous phase, and
+ * the first phase defaults to size=l:64:1, life=e:1000.  Sizes are
+ * rounded and clamped to [1, max size]; lifetimes are rounded up to at
+ * least 1.
+ *
+ * The trace lists, in time order, the allocation of each block and any
+ * realloc and free requests that fall due before the next allocation.
+ * Blocks still live at the end are freed in order of allocation.
+ */
+#include <errno.h>
+#include <math.h>
+#include <stdarg.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#define MAX_COMPONENTS 16 /* components of a size mixture */
+#define MAX_PHASES 64
+
+/* A distribution of sizes or lifetimes */
+typedef struct
+{
+    char kind;  /* one of c, u, e, l, p, or i for "inf" */
+    double a;   /* constant, lower bound, mean, median or minimum */
+    double b;   /* upper bound, log deviation or shape */
+} dist_t;
+
+/* A weighted mixture of distributions */
+typedef struct
+{
+    int count;
+    double weight[MAX_COMPONENTS]; /* cumulative, ending at 1 */
+    dist_t dist[MAX_COMPONENTS];
+} mixture_t;
+
+/* Parameters of one phase of the workload */
+typedef struct
+{
+    long count;         /* blocks allocated */
+    mixture_t size;     /* block sizes */
+    dist_t life;        /* block lifetimes */
+    double realloc_frac; /* fraction of blocks that are reallocated */
+    int realloc_steps;  /* reallocations of each such block */
+    char growth;        /* g to multiply size, a to add to it */
+    double growth_by;   /* factor or number of bytes */
+    double free_frac;   /* fraction of live blocks freed on entry */
+} phase_t;
+
+/* A realloc or free request that falls due at a given time */
+typedef struct
+{
+    long time; /* number of allocations made before it */
+    long seq;  /* breaks ties in order of scheduling */
+    int id;
+    char type; /* 'r' or 'f' */
+} event_t;
+
+/* A request written to the trace */
+typedef struct
+{
+    char type;
+    int id;
+    size_t size;
+} op_t;
+
+/* Block state, indexed by id */
+typedef struct
+{
+    size_t size;
+    bool live;
+} block_t;
+
+/* Command line settings */
+static unsigned seed = 15213;
+static int weight = 1;
+static size_t max_size = (size_t)1 << 24;
+static bool verbose = false;
+
+/* Pending requests, as a binary min-heap on (time, seq) */
+static event_t *events = NULL;
+static long num_events = 0;
+static long max_events = 0;
+static long event_seq = 0;
+
+/* Generated trace */
+static op_t *ops = NULL;
+static long num_ops = 0;
+static long max_ops = 0;
+static block_t *blocks = NULL;
+static int num_ids = 0;
+static size_t live_bytes = 0;
+static size_t peak_bytes = 0;
+
+static void app_error(const char *fmt, ...)
+{
+    va_list ap;
+    va_start(ap, fmt);
+    fprintf(stderr, "gentrace: ");
+    vfprintf(stderr, fmt, ap);
+    va_end(ap);
+    exit(1);
+}
+
+/* Grow a dynamic array to hold at least need elements */
+static void *grow(void *array, long *max, long need, size_t elem)
+{
+    if (need <= *max)
+        return array;
+    long n = *max ? *max : 1024;
+    while (n < need)
+        n *= 2;
+    array = realloc(array, n * elem);
+    if (array == NULL)
+        app_error("out of memory\n");
+    *max = n;
+    return array;
+}
+
+/*****************************************************************
+ * Random numbers
+ ****************************************************************/
+
+/* Uniform over (0, 1) */
+static double uniform(void)
+{
+    return (random() + 0.5) / ((double)RAND_MAX + 1.0);
+}
+
+static double normal(void)
+{
+    return sqrt(-2.0 * log(uniform())) * cos(2.0 * M_PI * uniform());
+}
+
+static double sample(const dist_t *d)
+{
+    switch (d->kind)
+    {
+    case 'c':
+        return d->a;
+    case 'u':
+        return d->a + (d->b - d->a) * uniform();
+    case 'e':
+        return -d->a * log(uniform());
+    case 'l':
+        return d->a * exp(d->b * normal());
+    case 'p':
+        return d->a / pow(uniform(), 1.0 / d->b);
+    default:
+        return INFINITY;
+    }
+}
+
+static size_t sample_size(const mixture_t *m)
+{
+    double u = uniform();
+    int i = 0;
+    while (i < m->count - 1 && u > m->weight[i])
+        i++;
+    double x = round(sample(&m->dist[i]));
+    if (x < 1.0)
+        return 1;
+    if (x > (double)max_size)
+        return max_size;
+    return (size_t)x;
+}
+
+/*****************************************************************
+ * Parsing phase descriptions
+ ****************************************************************/
+
+static double parse_number(const char *s, char **end, const char *what)
+{
+    errno = 0;
+    double x = strtod(s, end);
+    if (*end == s || errno != 0 || !isfinite(x) || x < 0)
+        app_error("bad number in %s: \"%s\"\n", what, s);
+    return x;
+}
+
+/* Parse a distribution at s, and return where it ends */
+static const char *parse_dist(const char *s, dist_t *d, const char *what)
+{
+    char *end;
+    if (strncmp(s, "inf", 3) == 0)
+    {
+        d->kind = 'i';
+        return s + 3;
+    }
+    d->kind = s[0];
+    if (strchr("cuelp", d->kind) == NULL || d->kind == '\0' || s[1] != ':')
+        app_error("unknown distribution in %s: \"%s\"\n", what, s);
+    d->a = parse_number(s + 2, &end, what);
+    d->b = 0.0;
+    if (d->kind != 'c' && d->kind != 'e')
+    {
+        if (*end != ':')
+            app_error("%s needs two parameters: \"%s\"\n", what, s);
+        d->b = parse_number(end + 1, &end, what);
+    }
+    if ((d->kind == 'u' && d->b < d->a) ||
+        ((d->kind == 'p' || d->kind == 'e' || d->kind == 'l') && d->a <= 0) ||
+        (d->kind == 'p' && d->b <= 0))
+        app_error("bad parameters in %s: \"%s\"\n", what, s);
+    return end;
+}
+
+static void parse_mixture(const char *s, mixture_t *m)
+{
+    double total = 0.0;
+    int i;
+    m->count = 0;
+    while (true)
+    {
+        if (m->count == MAX_COMPONENTS)
+            app_error("more than %d size components\n", MAX_COMPONENTS);
+        double w = 1.0;
+        char *end;
+        const char *star = strchr(s, '*');
+        const char *plus = strchr(s, '+');
+        if (star && (!plus || star < plus))
+        {
+            w = parse_number(s, &end, "size weight");
+            if (end != star)
+                app_error("bad size weight: \"%s\"\n", s);
+            s = star + 1;
+        }
+        s = parse_dist(s, &m->dist[m->count], "size");
+        if (m->dist[m->count].kind == 'i')
+            app_error("sizes cannot be infinite\n");
+        total += w;
+        m->weight[m->count++] = total;
+        if (*s == '\0')
+            break;
+        if (*s != '+')
+            app_error("unexpected \"%s\" in size\n", s);
+        s++;
+    }
+    if (total <= 0.0)
+        app_error("size weights add up to zero\n");
+    for (i = 0; i < m->count; i++)
+        m->weight[i] /= total;
+}
+
+static void parse_phase(char *spec, phase_t *p)
+{
+    char *field;
+    char *save;
+    p->count = 0;
+    p->free_frac = 0.0;
+    for (field = strtok_r(spec, ",", &save); field;
+         field = strtok_r(NULL, ",", &save))
+    {
+        char *value = strchr(field, '=');
+        char *end;
+        if (!value)
+            app_error("field \"%s\" is not of the form name=value\n", field);
+        *value++ = '\0';
+        if (strcmp(field, "n") == 0)
+        {
+            p->count = (long)parse_number(value, &end, "n");
+            if (*end != '\0' || p->count < 1)
+                app_error("bad block count: \"%s\"\n", value);
+        }
+        else if (strcmp(field, "size") == 0)
+            parse_mixture(value, &p->size);
+        else if (strcmp(field, "life") == 0)
+        {
+            if (*parse_dist(value, &p->life, "life") != '\0')
+                app_error("unexpected text after lifetime: \"%s\"\n", value);
+        }
+        else if (strcmp(field, "realloc") == 0)
+        {
+            p->realloc_frac = parse_number(value, &end, "realloc");
+            if (*end == '\0' && p->realloc_frac == 0.0)
+            {
+                p->realloc_steps = 0; /* realloc=0 turns reallocs off */
+                continue;
+            }
+            if (*end != ':')
+                app_error("realloc needs <fraction>:<steps>:<growth>\n");
+            p->realloc_steps = (int)parse_number(end + 1, &end, "realloc");
+            if (*end != ':' || (end[1] != 'g' && end[1] != 'a'))
+                app_error("realloc growth must be g<factor> or a<bytes>\n");
+            p->growth = end[1];
+            p->growth_by = parse_number(end + 2, &end, "realloc");
+            if (*end != '\0' || p->realloc_frac > 1.0)
+                app_error("bad realloc: \"%s\"\n", value);
+        }
+        else if (strcmp(field, "free") == 0)
+        {
+            p->free_frac = parse_number(value, &end, "free");
+            if (*end != '\0' || p->free_frac > 1.0)
+                app_error("bad free fraction: \"%s\"\n", value);
+        }
+        else
+            app_error("unknown field \"%s\"\n", field);
+    }
+    if (p->count == 0)
+        app_error("every phase needs n=<count>\n");
+}
+
+/*****************************************************************
+ * Generating the trace
+ ****************************************************************/
+
+static bool event_before(const event_t *x, const event_t *y)
+{
+    return x->time < y->time || (x->time == y->time && x->seq < y->seq);
+}
+
+static void event_push(long time, int id, char type)
+{
+    events = grow(events, &max_events, num_events + 1, sizeof(event_t));
+    long i = num_events++;
+    event_t e = {time, event_seq++, id, type};
+    while (i > 0 && event_before(&e, &events[(i - 1) / 2]))
+    {
+        events[i] = events[(i - 1) / 2];
+        i = (i - 1) / 2;
+    }
+    events[i] = e;
+}
+
+static event_t event_pop(void)
+{
+    event_t top = events[0];
+    event_t last = events[--num_events];
+    long i = 0;
+    while (true)
+    {
+        long c = 2 * i + 1;
+        if (c >= num_events)
+            break;
+        if (c + 1 < num_events && event_before(&events[c + 1], &events[c]))
+            c++;
+        if (!event_before(&events[c], &last))
+            break;
+        events[i] = events[c];
+        i = c;
+    }
+    if (num_events > 0)
+        events[i] = last;
+    return top;
+}
+
+static void emit(char type, int id, size_t size)
+{
+    ops = grow(ops, &max_ops, num_ops + 1, sizeof(op_t));
+    ops[num_ops].type = type;
+    ops[num_ops].id = id;
+    ops[num_ops].size = size;
+    num_ops++;
+    if (live_bytes > peak_bytes)
+        peak_bytes = live_bytes;
+}
+
+static void free_block(int id)
+{
+    blocks[id].live = false;
+    live_bytes -= blocks[id].size;
+    emit('f', id, 0);
+}
+
+static void realloc_block(const phase_t *p, int id)
+{
+    size_t size = blocks[id].size;
+    double grown = p->growth == 'g' ? round(size * p->growth_by)
+                                    : size + p->growth_by;
+    size_t new_size = grown > (double)max_size ? max_size : (size_t)grown;
+    if (new_size < 1)
+        new_size = 1;
+    live_bytes += new_size - size;
+    blocks[id].size = new_size;
+    emit('r', id, new_size);
+}
+
+/* Issue the requests due before allocation number now */
+static void run_events(const phase_t *p, long now)
+{
+    while (num_events > 0 && events[0].time <= now)
+    {
+        event_t e = event_pop();
+        if (!blocks[e.id].live)
+            continue; /* Freed on entering a phase */
+        if (e.type == 'f')
+            free_block(e.id);
+        else
+            realloc_block(p, e.id);
+    }
+}
+
+static void generate(phase_t *phases, int num_phases)
+{
+    long total = 0;
+    long now = 0;
+    int i, id;
+    for (i = 0; i < num_phases; i++)
+        total += phases[i].count;
+    if (total > INT32_MAX)
+        app_error("too many blocks\n");
+    blocks = calloc(total, sizeof(block_t));
+    if (blocks == NULL)
+        app_error("out of memory\n");
+
+    for (i = 0; i < num_phases; i++)
+    {
+        phase_t *p = &phases[i];
+        long j;
+        if (p->free_frac > 0.0)
+            for (id = 0; id < num_ids; id++)
+                if (blocks[id].live && uniform() < p->free_frac)
+                    free_block(id);
+        for (j = 0; j < p->count; j++, now++)
+        {
+            run_events(p, now);
+            id = num_ids++;
+            blocks[id].size = sample_size(&p->size);
+            blocks[id].live = true;
+            live_bytes += blocks[id].size;
+            emit('a', id, blocks[id].size);
+
+            /* Blocks that live forever are reallocated over the phase */
+            double life = ceil(sample(&p->life));
+            double span = isinf(life) ? (double)p->count : life;
+            if (life < 1.0)
+                life = span = 1.0;
+            if (p->realloc_steps > 0 && uniform() < p->realloc_frac)
+            {
+                int k;
+                for (k = 1; k <= p->realloc_steps; k++)
+                    event_push(now + (long)(span * k /
+                                            (p->realloc_steps + 1)),
+                               id, 'r');
+            }
+            if (!isinf(life))
+                event_push(now + (long)life, id, 'f');
+        }
+    }
+    /* Let the remaining requests fall due, then free the survivors */
+    run_events(&phases[num_phases - 1], INT64_MAX);
+    for (id = 0; id < num_ids; id++)
+        if (blocks[id].live)
+            free_block(id);
+}
+
+static void write_trace(const char *filename)
+{
+    FILE *f = fopen(filename, "w");
+    long i;
+    if (f == NULL)
+        app_error("couldn't open %s for writing\n", filename);
+    fprintf(f, "%d\n%d\n%ld\n%zu\n", weight, num_ids, num_ops, peak_bytes);
+    for (i = 0; i < num_ops; i++)
+    {
+        if (ops[i].type == 'f')
+            fprintf(f, "f %d\n", ops[i].id);
+        else
+            fprintf(f, "%c %d %zu\n", ops[i].type, ops[i].id, ops[i].size);
+    }
+    if (fclose(f) != 0)
+        app_error("couldn't write %s\n", filename);
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-hvB] [-s <seed>] [-w <weight>] [-M <bytes>] "
+            "-o <file> <phase>...\n",
+            prog);
+    fprintf(stderr, "Options\n");
+    fprintf(stderr, "\t-o <file>  Write the trace to <file>.\n");
+    fprintf(stderr, "\t-s <seed>  Seed the random numbers (default %u).\n",
+            seed);
+    fprintf(stderr, "\t-w <w>     Weight recorded in the trace (default %d).\n",
+            weight);
+    fprintf(stderr, "\t-M <bytes> Largest block size (default %zu).\n",
+            max_size);
+    fprintf(stderr,
+            "\t-B         Also write a binary copy with ./mdriver -B.\n");
+    fprintf(stderr, "\t-v         Print a summary of the trace.\n");
+    fprintf(stderr, "\t-h         Print this message.\n");
+    fprintf(stderr, "Each <phase> is a list of fields, such as\n");
+    fprintf(stderr, "\tn=10000,size=0.9*l:48:0.7+0.1*p:4096:1.2,life=e:500,"
+                    "realloc=0.05:3:g2\n");
+    fprintf(stderr, "See the top of gentrace.c for the full syntax.\n");
+}
+
+int main(int argc, char **argv)
+{
+    phase_t phases[MAX_PHASES];
+    const char *outfile = NULL;
+    bool binary = false;
+    int c, i;
+
+    while ((c = getopt(argc, argv, "o:s:w:M:Bvh")) != EOF)
+    {
+        switch (c)
+        {
+        case 'o':
+            outfile = optarg;
+            break;
+        case 's':
+            seed = (unsigned)strtoul(optarg, NULL, 0);
+            break;
+        case 'w':
+            weight = atoi(optarg);
+            break;
+        case 'M':
+            max_size = (size_t)strtoull(optarg, NULL, 0);
+            if (max_size < 1)
+                app_error("bad maximum size: \"%s\"\n", optarg);
+            break;
+        case 'B':
+            binary = true;
+            break;
+        case 'v':
+            verbose = true;
+            break;
+        case 'h':
+            usage(argv[0]);
+            exit(0);
+        default:
+            usage(argv[0]);
+            exit(1);
+        }
+    }
+    if (outfile == NULL || optind == argc)
+    {
+        usage(argv[0]);
+        exit(1);
+    }
+    if (argc - optind > MAX_PHASES)
+        app_error("more than %d phases\n", MAX_PHASES);
+
+    /* The first phase has no earlier one to inherit from */
+    memset(&phases[0], 0, sizeof(phase_t));
+    phases[0].size.count = 1;
+    phases[0].size.weight[0] = 1.0;
+    phases[0].size.dist[0] = (dist_t){'l', 64, 1.0};
+    phases[0].life = (dist_t){'e', 1000, 0};
+    for (i = 0; i < argc - optind; i++)
+    {
+        if (i > 0)
+            phases[i] = phases[i - 1];
+        parse_phase(argv[optind + i], &phases[i]);
+    }
+
+    srandom(seed);
+    generate(phases, argc - optind);
+    write_trace(outfile);
+    if (verbose)
+        printf("%s: %d ids, %ld requests, peak %zu bytes\n", outfile, num_ids,
+               num_ops, peak_bytes);
+
+    if (binary)
+    {
+        char cmd[4096];
+        snprintf(cmd, sizeof(cmd), "./mdriver -v0 -B -f '%s'", outfile);
+        if (system(cmd) != 0)
+            app_error("\"%s\" failed\n", cmd);
+    }
+    return 0;
+}
@@ -9,15 +9,20 @@
  */
 #include <assert.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <float.h>
 #include <math.h>
 #include <setjmp.h>
 #include <signal.h>
 #include <stdarg.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -25,11 +30,15 @@
 #include <sanitizer/msan_interface.h>
 #endif
 
+#ifdef MT_MODE
+#include <pthread.h>
+#endif
+
+#include "clock.h"
 #include "config.h"
 #include "fcyc.h"
 #include "memlib.h"
 #include "mm.h"
-#include "stree.h"
 
 /**********************
  * Constants and macros
@@ -45,8 +54,13 @@
 #define REF_ONLY 0
 #endif
 
-/* Returns true if p is ALIGNMENT-byte aligned */
-#define IS_ALIGNED(p) ((((unsigned long)(p)) % ALIGNMENT) == 0)
+/* Built against a thread-safe allocator, for multithreaded speed runs */
+#ifndef MT_MODE
+#define MT_MODE 0
+#endif
+
+/* Returns true if p is a-byte aligned */
+#define IS_ALIGNED(p, a) ((((unsigned long)(p)) % (a)) == 0)
 
 /* weights */
 typedef enum
@@ -69,41 +83,90 @@ typedef enum
  */
 
 /*
- * Records the extent of each block's payload.
- * Organized as doubly linked list
+ * Records the extent of each block's payload, in a B+ tree keyed by low
+ * payload address.  Leaves hold the ranges themselves in sorted arrays and
+ * are chained in address order.  Inner nodes hold, for each child, the
+ * lowest address in its subtree.  Every node but the root is at least half
+ * full.
  */
-typedef struct range_t
+#define RANGE_FANOUT 32  /* entries per node */
+#define RANGE_CHUNK 256  /* nodes allocated at a time */
+
+typedef struct range_node_t
+{
+    int count;                 /* number of entries in use */
+    bool leaf;                 /* holds ranges rather than children */
+    struct range_node_t *next; /* next leaf, or next free node */
+    char *lo[RANGE_FANOUT];    /* low payload address / lowest in child */
+    union
+    {
+        struct range_node_t *child[RANGE_FANOUT];
+        struct
+        {
+            char *hi[RANGE_FANOUT]; /* high payload address */
+            int index[RANGE_FANOUT]; /* same index as free; for debugging */
+        };
+    };
+} range_node_t;
+
+/* Nodes are carved out of chunks, which are freed with the range set */
+typedef struct range_chunk_t
 {
-    char *lo;   /* low payload address */
-    char *hi;   /* high payload address */
-    int index;  /* same index as free; for debugging */
-    struct range_t *next;
-    struct range_t *prev;
-} range_t;
+    struct range_chunk_t *next;
+    range_node_t nodes[RANGE_CHUNK];
+} range_chunk_t;
 
 /*
- * All information about set of ranges represented as doubly-linked
- * list of ranges, plus a splay tree keyed by lo addresses
+ * All information about set of ranges
  */
 typedef struct
 {
-    range_t *list;
-    tree_t *lo_tree;
+    range_node_t *root;
+    range_node_t *free_nodes;
+    range_chunk_t *chunks;
 } range_set_t;
 
-/* Characterizes a single trace operation (allocator request) */
+/*
+ * Characterizes a single trace operation (allocator request).  Binary
+ * traces hold these records as is, so change TRACE_MAGIC along with the
+ * layout.
+ */
 typedef struct
 {
     enum
     {
         ALLOC,
         FREE,
-        REALLOC
-    } type;      /* type of request */
-    int index;   /* index for free() to use later */
-    size_t size; /* byte size of alloc/realloc request */
+        REALLOC,
+        MEMALIGN,
+        FREE_SIZED,
+        ALLOC_BATCH,
+        FREE_BATCH
+    } type;       /* type of request */
+    int index;    /* index for free() to use later */
+    size_t size;  /* byte size of alloc/realloc request */
+    size_t align; /* payload alignment of a memalign request */
+    int count;    /* number of ids index.. of a batch request */
 } traceop_t;
 
+/*
+ * Header of a binary trace (.rtb), which holds the same requests as a
+ * text trace (.rep) as num_ops traceop_t records right after the header,
+ * so that the driver can map the file and replay it in place
+ */
+#define TRACE_MAGIC "mmtrace1"
+typedef struct
+{
+    char magic[8];       /* TRACE_MAGIC */
+    uint32_t op_size;    /* sizeof(traceop_t) of the converting driver */
+    int32_t weight;      /* weight for this trace */
+    int32_t num_ids;     /* number of alloc/realloc ids */
+    int32_t num_ops;     /* number of distinct requests */
+    int32_t num_calls;   /* number of blocks requested or freed */
+    int32_t unused;      /* keeps the records 8-byte aligned */
+    uint64_t data_bytes; /* Peak number of data bytes allocated */
+} trace_header_t;
+
 /* Holds the information for one trace file */
 typedef struct
 {
@@ -111,13 +174,41 @@ typedef struct
     size_t data_bytes;    /* Peak number of data bytes allocated during trace */
     int num_ids;          /* number of alloc/realloc ids */
     int num_ops;          /* number of distinct requests */
+    int num_calls;        /* number of blocks requested or freed */
     weight_t weight;      /* weight for this trace */
     traceop_t *ops;       /* array of requests */
+    size_t map_bytes;     /* length of the binary trace ops is mapped from */
     char **blocks;        /* array of ptrs returned by malloc/realloc... */
     size_t *block_sizes;  /* ... and a corresponding array of payload sizes */
     size_t *block_rand_base; /* index into random_data, if debug is on */
 } trace_t;
 
+/*
+ * Log-scaled histogram of the latencies, in ticks, of one type of request.
+ * Each power of two is split into 1 << LAT_SUB_BITS buckets, so that a
+ * bucket spans at most a quarter of its lower bound.
+ */
+#define LAT_SUB_BITS 2
+#define LAT_BUCKETS (64 << LAT_SUB_BITS)
+typedef struct
+{
+    unsigned long long count;              /* requests timed */
+    unsigned long long max;                /* slowest of them */
+    unsigned long long bucket[LAT_BUCKETS]; /* requests per latency range */
+} lat_hist_t;
+
+/* Latencies of the requests of one replay, and the slowest of them */
+#define LAT_SLOWEST 4 /* number of slowest requests kept */
+typedef struct
+{
+    lat_hist_t hist[FREE_BATCH + 1]; /* one histogram per request type */
+    struct
+    {
+        traceop_t op;
+        unsigned long long ticks;
+    } slowest[LAT_SLOWEST]; /* slowest requests, slowest first */
+} latency_t;
+
 /*
  * Holds the params to the xxx_speed functions, which are timed by fcyc.
  * This struct is necessary because fcyc accepts only a pointer array
@@ -127,8 +218,21 @@ typedef struct
 {
     trace_t *trace;
     range_set_t *ranges;
+    struct mt_part *parts; /* per-thread requests of a multithreaded run */
+    latency_t *lat;        /* where to time each request, if not NULL */
 } speed_t;
 
+/* The requests one thread issues in a multithreaded speed run */
+typedef struct mt_part
+{
+    traceop_t *ops; /* the thread's requests, in trace order... */
+    int num_ops;    /* ... and how many there are */
+    int num_calls;  /* number of blocks they request or free */
+    char **blocks;  /* the thread's own pointers for the trace's ids */
+    double secs;    /* fastest the thread issued them in, over the runs */
+    latency_t *lat; /* where to time each request, if not NULL */
+} mt_part_t;
+
 /* Summarizes the important stats for some malloc function on some trace */
 typedef struct
 {
@@ -164,12 +268,17 @@ typedef struct
  * realloc and when we free.  With DBG_EXPENSIVE, we check every block
  * every operation.
  * randint_t should be a byte, in case students return unaligned memory.
+ * The first MAXFILL values are repeated past the end of random_data, so
+ * that the data for any block is a contiguous slice of it.
  *******************/
 #define RANDOM_DATA_LEN (1 << 16)
 
 typedef unsigned char randint_t;
 static const char randint_t_name[] = "byte";
-static randint_t random_data[RANDOM_DATA_LEN];
+static randint_t random_data[RANDOM_DATA_LEN + MAXFILL];
+
+/* Number of values checked with each mem_read */
+#define RANDOM_WORD (sizeof(uint64_t) / sizeof(randint_t))
 
 /********************
  * Global variables
@@ -187,7 +296,15 @@ static debug_mode_t debug_mode = REF_ONLY ? DBG_NONE : DBG_CHEAP;
 int verbose = REF_ONLY ? 0 : 1; /* global flag for verbose output */
 static int errors = 0; /* number of errs found when running student malloc */
 static bool onetime_flag = false;
+static bool convert_flag = false; /* Write binary traces instead of running */
 static bool tab_mode = false; /* Print output as tab-separated fields */
+static int num_jobs = 1; /* Processes checking traces at once (-j) */
+#if !REF_ONLY
+static bool dump_stats = false; /* Print allocator statistics per trace */
+static int mt_threads = 0;      /* Threads to time each trace on (-P) */
+static bool mt_copies = false;  /* Each thread replays the whole trace (-R) */
+static bool latency_flag = false; /* Time each request of each trace (-L) */
+#endif
 /* If set, use sparse memory emulation */
 static bool sparse_mode = SPARSE_MODE;
 static size_t maxfill = SPARSE_MODE ? MAXFILL_SPARSE : MAXFILL;
@@ -233,7 +350,8 @@ static void add_tracefile(char *trace);
 /* these functions manipulate range sets */
 static range_set_t *new_range_set();
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, int opnum, int index);
+                      size_t align, const trace_t *trace, int opnum,
+                      int index);
 static void remove_range(range_set_t *ranges, char *lo);
 static void free_range_set(range_set_t *ranges);
 
@@ -245,8 +363,10 @@ static void randomize_block(trace_t *trace, int index);
 /* These functions read, allocate, and free storage for traces */
 static trace_t *read_trace(stats_t *stats, const char *tracedir,
                            const char *filename);
+static void check_trace_id(const trace_t *trace, int index);
 static void reinit_trace(trace_t *trace);
 static void free_trace(trace_t *trace);
+static void convert_trace(const char *tracedir, const char *filename);
 
 /* Routines for evaluating the correctness and speed of libc malloc */
 static bool eval_libc_valid(trace_t *trace);
@@ -256,7 +376,19 @@ static void eval_libc_speed(void *ptr);
    of the student's malloc package in mm.c */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges);
 static double eval_mm_util(trace_t *trace, int tracenum);
+static void replay_mm(const traceop_t *ops, int num_ops, char **blocks,
+                      latency_t *lat);
 static void eval_mm_speed(void *ptr);
+#if MT_MODE
+static double time_mm_mt_speed(stats_t *stats, speed_t *speed_params);
+#endif
+#if !REF_ONLY
+static void eval_mm_latency(speed_t *speed_params);
+#endif
+static void *call_memalign(size_t align, size_t size);
+static void call_free_sized(void *ptr, size_t size);
+static size_t call_malloc_batch(size_t size, size_t n, char **out);
+static void call_free_batch(char **ptrs, size_t n);
 
 /* Various helper routines */
 static void printresults(int n, stats_t *stats, sum_stats_t *sumstats);
@@ -283,6 +415,149 @@ static void timeout_handler(int sig __attribute__((unused)))
 static double lookup_ref_throughput(bool checkpoint);
 static double measure_ref_throughput(bool checkpoint);
 
+/*
+ * check_trace - run the validity passes of the trace, and the
+ *     utilization pass unless the trace is only being checked (-c),
+ *     into stats.  *ranges is replaced by the ranges of the last pass.
+ */
+static void check_trace(trace_t *trace, range_set_t **ranges, stats_t *stats,
+                        int tracenum)
+{
+    if (verbose > 1)
+        printf("Checking mm_malloc for correctness, ");
+    stats->valid =
+        /* Do 2 tests, since may fail to reinitialize properly */
+        eval_mm_valid(trace, *ranges);
+
+    free_range_set(*ranges);
+    *ranges = new_range_set();
+    stats->valid = stats->valid && eval_mm_valid(trace, *ranges);
+
+    if (!stats->valid || onetime_flag)
+        return;
+
+    if (verbose > 1)
+        printf("efficiency, ");
+    stats->util = eval_mm_util(trace, tracenum);
+#if !REF_ONLY
+    if (dump_stats)
+    {
+        printf("# trace %s\n", trace->filename);
+        mm_stats_dump(stdout);
+    }
+#endif
+}
+
+/*
+ * check_worker - body of a worker process of check_tests: check one
+ *     trace against a simulated memory system of its own, and send its
+ *     stats and error count back through fd
+ */
+static void check_worker(int fd, const char *tracedir, const char *tracefile,
+                         int tracenum)
+{
+    stats_t stats;
+
+    errors = 0;
+    memset(&stats, 0, sizeof(stats));
+    mem_init(sparse_mode);
+    range_set_t *ranges = new_range_set();
+    trace_t *trace = read_trace(&stats, tracedir, tracefile);
+    stats.ops = trace->num_calls;
+    check_trace(trace, &ranges, &stats, tracenum);
+
+    if (write(fd, &stats, sizeof(stats)) != (ssize_t)sizeof(stats) ||
+        write(fd, &errors, sizeof(errors)) != (ssize_t)sizeof(errors))
+        _exit(1);
+    _exit(0);
+}
+
+/*
+ * check_tests - run the validity and utilization passes of the traces
+ *     in up to num_jobs worker processes at once, and collect their
+ *     stats into mm_stats.  A worker that dies or times out leaves its
+ *     trace invalid.
+ */
+static void check_tests(int num_tracefiles, const char *tracedir,
+                        char **tracefiles, stats_t *mm_stats)
+{
+    pid_t *pids;
+    int *fds;
+    volatile int next = 0, running = 0;
+    int i, status, worker_errors;
+    pid_t pid;
+
+    if ((pids = calloc(num_tracefiles, sizeof(*pids))) == NULL ||
+        (fds = calloc(num_tracefiles, sizeof(*fds))) == NULL)
+        unix_error("calloc failed in check_tests");
+
+    /* On a timeout, the traces being checked are given up on */
+    if (setjmp(timeout_jmpbuf) != 0)
+    {
+        for (i = 0; i < next; i++)
+        {
+            if (pids[i] == 0)
+                continue;
+            kill(pids[i], SIGKILL);
+            waitpid(pids[i], NULL, 0);
+            close(fds[i]);
+            pids[i] = 0;
+            mm_stats[i].valid = false;
+            strcpy(mm_stats[i].filename, tracefiles[i]);
+        }
+        running = 0;
+    }
+
+    while (next < num_tracefiles || running > 0)
+    {
+        if (running < num_jobs && next < num_tracefiles)
+        {
+            int pipefd[2];
+            if (pipe(pipefd) < 0)
+                unix_error("pipe failed in check_tests");
+            if ((pid = fork()) < 0)
+                unix_error("fork failed in check_tests");
+            if (pid == 0)
+            {
+                close(pipefd[0]);
+                check_worker(pipefd[1], tracedir, tracefiles[next], next);
+            }
+            close(pipefd[1]);
+            pids[next] = pid;
+            fds[next] = pipefd[0];
+            next++;
+            running++;
+            continue;
+        }
+
+        if ((pid = wait(&status)) < 0)
+            unix_error("wait failed in check_tests");
+        for (i = 0; i < next && pids[i] != pid; i++)
+            ;
+        if (i == next)
+            continue;
+        pids[i] = 0;
+        running--;
+
+        if (!WIFEXITED(status) || WEXITSTATUS(status) != 0 ||
+            read(fds[i], &mm_stats[i], sizeof(mm_stats[i])) !=
+                (ssize_t)sizeof(mm_stats[i]) ||
+            read(fds[i], &worker_errors, sizeof(worker_errors)) !=
+                (ssize_t)sizeof(worker_errors))
+        {
+            fprintf(stderr, "The worker checking %s died\n", tracefiles[i]);
+            mm_stats[i].valid = false;
+            strcpy(mm_stats[i].filename, tracefiles[i]);
+            worker_errors = 1;
+        }
+        errors += worker_errors;
+        close(fds[i]);
+    }
+
+    free(pids);
+    free(fds);
+}
+
 /*
  * Run the tests; return the number of tests run (may be less than
  * num_tracefiles, if there's a timeout)
@@ -292,9 +567,17 @@ static void run_tests(int num_tracefiles, const char *tracedir,
                       speed_t *speed_params)
 {
     volatile int i;
+    bool checked = num_jobs > 1 && !onetime_flag;
+
+    if (checked)
+        check_tests(num_tracefiles, tracedir, tracefiles, mm_stats);
 
     for (i = 0; i < num_tracefiles; i++)
     {
+        /* traces the workers found invalid are not timed */
+        if (checked && !mm_stats[i].valid)
+            continue;
+
         /* initialize simulated memory system in memlib.c *
          * start each trace with a clean system */
         mem_init(sparse_mode);
@@ -305,25 +588,16 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         trace_t *trace;
         trace = read_trace(&mm_stats[i], tracedir, tracefiles[i]);
         strcpy(mm_stats[i].filename, trace->filename);
-        mm_stats[i].ops = trace->num_ops;
+        mm_stats[i].ops = trace->num_calls;
 
         /* Prepare for timeout */
         if (setjmp(timeout_jmpbuf) != 0)
         {
             mm_stats[i].valid = false;
         }
-        else
+        else if (!checked)
         {
-            if (verbose > 1)
-                printf("Checking mm_malloc for correctness, ");
-            mm_stats[i].valid =
-                /* Do 2 tests, since may fail to reinitialize properly */
-                eval_mm_valid(trace, ranges);
-
-			free_range_set(ranges);
-			ranges = new_range_set();
-			mm_stats[i].valid = mm_stats[i].valid &&
-				eval_mm_valid(trace, ranges);
+            check_trace(trace, &ranges, &mm_stats[i], i);
 
             if (onetime_flag)
             {
@@ -334,23 +608,24 @@ static void run_tests(int num_tracefiles, const char *tracedir,
         }
         if (mm_stats[i].valid)
         {
-            if (verbose > 1)
-                printf("efficiency, ");
-            mm_stats[i].util = eval_mm_util(trace, i);
             speed_params->trace = trace;
             speed_params->ranges = ranges;
             if (verbose > 1)
                 printf("and performance.\n");
-            mm_stats[i].secs =
-                sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
+#if MT_MODE
+            if (mt_threads > 0)
+                mm_stats[i].secs = time_mm_mt_speed(&mm_stats[i], speed_params);
+            else
+#endif
+                mm_stats[i].secs =
+                    sparse_mode ? 1.0 : fsec(eval_mm_speed, speed_params);
+#if !REF_ONLY
+            if (latency_flag && !sparse_mode)
+                eval_mm_latency(speed_params);
+#endif
             mm_stats[i].tput = mm_stats[i].ops / (mm_stats[i].secs * 1000.0);
         }
 
-#if 0
-        printf(" %d operations.  %ld comparisons.  Avg = %.1f\n",
-               trace->num_ops, ranges->lo_tree->comparison_count,
-               (double) ranges->lo_tree->comparison_count / trace->num_ops);
-#endif
         free_trace(trace);
         free_range_set(ranges);
 
@@ -376,6 +651,7 @@ int main(int argc, char **argv)
     bool autograder = false; /* if set then called by autograder (-A) */
     bool checkpoint = false;
 
+    memset(&speed_params, 0, sizeof(speed_params));
     setbuf(stdout, 0);
     setbuf(stderr, 0);
 
@@ -388,7 +664,7 @@ int main(int argc, char **argv)
     /*
      * Read and interpret the command line arguments
      */
-    while ((c = getopt(argc, argv, "d:f:c:s:t:v:hpCOVAlDT")) != EOF)
+    while ((c = getopt(argc, argv, "d:f:c:j:s:t:v:P:hpBCOVAlDLRST")) != EOF)
     {
         switch (c)
         {
@@ -403,13 +679,13 @@ int main(int argc, char **argv)
 
         case 'f': /* Use one specific trace file only (relative to curr dir) */
             add_tracefile(optarg);
-            strcpy(tracedir, "./");
+            strcpy(tracedir, optarg[0] == '/' ? "" : "./");
             break;
 
         case 'c': /* Use one specific trace file and run only once */
             add_tracefile(optarg);
             onetime_flag = true;
-            strcpy(tracedir, "./");
+            strcpy(tracedir, optarg[0] == '/' ? "" : "./");
             break;
 
         case 't': /* Directory where the traces are located */
@@ -449,6 +725,37 @@ int main(int argc, char **argv)
             tab_mode = true;
             break;
 
+        case 'S':
+            dump_stats = true;
+            break;
+
+        case 'B':
+            convert_flag = true;
+            break;
+
+        case 'P': /* Time each trace on several threads */
+            mt_threads = atoi(optarg);
+            if (!MT_MODE)
+                app_error("-P needs mdriver-mt, which is built with a "
+                          "thread-safe allocator\n");
+            if (mt_threads < 1)
+                app_error("-P needs a positive number of threads\n");
+            break;
+
+        case 'R':
+            mt_copies = true;
+            break;
+
+        case 'L':
+            latency_flag = true;
+            break;
+
+        case 'j': /* Check traces in several processes at once */
+            num_jobs = atoi(optarg);
+            if (num_jobs < 1)
+                app_error("-j needs a positive number of processes\n");
+            break;
+
         case 'h': /* Print this message */
             usage(argv[0]);
             exit(0);
@@ -472,6 +779,16 @@ int main(int argc, char **argv)
             add_tracefile(default_tracefiles[i]);
     }
 
+    /*
+     * With -B, write a binary copy of each trace instead of running it
+     */
+    if (convert_flag)
+    {
+        for (i = 0; i < num_global_tracefiles; i++)
+            convert_trace(tracedir, global_tracefiles[i]);
+        exit(0);
+    }
+
     if (debug_mode != DBG_NONE)
     {
         init_random_data();
@@ -773,42 +1090,263 @@ static void add_tracefile(char *trace)
  * range list to detect any overlapping allocated blocks.
  ****************************************************************/
 
+/*
+ * range_node_new - Take a node from the node pool of a range set
+ */
+static range_node_t *range_node_new(range_set_t *ranges, bool leaf)
+{
+    if (!ranges->free_nodes)
+    {
+        range_chunk_t *c = (range_chunk_t *)malloc(sizeof(range_chunk_t));
+        if (c == NULL)
+            unix_error("malloc error in range_node_new");
+        c->next = ranges->chunks;
+        ranges->chunks = c;
+        int i;
+        for (i = 0; i < RANGE_CHUNK; i++)
+        {
+            c->nodes[i].next = ranges->free_nodes;
+            ranges->free_nodes = &c->nodes[i];
+        }
+    }
+    range_node_t *n = ranges->free_nodes;
+    ranges->free_nodes = n->next;
+    n->count = 0;
+    n->leaf = leaf;
+    n->next = NULL;
+    return n;
+}
+
+/*
+ * range_node_free - Return a node to the node pool of a range set
+ */
+static void range_node_free(range_set_t *ranges, range_node_t *n)
+{
+    n->next = ranges->free_nodes;
+    ranges->free_nodes = n;
+}
+
+/*
+ * range_pos - Number of entries in node n whose address is <= lo
+ */
+static int range_pos(const range_node_t *n, const char *lo)
+{
+    int pos = 0;
+    while (pos < n->count && n->lo[pos] <= lo)
+        pos++;
+    return pos;
+}
+
+/*
+ * range_move - Move count entries of node src starting at spos to node dst
+ *     at dpos.  The entries of dst from dpos on must already be out of
+ *     the way.
+ */
+static void range_move(range_node_t *dst, int dpos, range_node_t *src,
+                       int spos, int count)
+{
+    memmove(&dst->lo[dpos], &src->lo[spos], count * sizeof(char *));
+    if (src->leaf)
+    {
+        memmove(&dst->hi[dpos], &src->hi[spos], count * sizeof(char *));
+        memmove(&dst->index[dpos], &src->index[spos], count * sizeof(int));
+    }
+    else
+        memmove(&dst->child[dpos], &src->child[spos],
+                count * sizeof(range_node_t *));
+}
+
+/*
+ * range_find - Find the leaf in which a range starting at lo belongs, and
+ *     set *pos to the number of its entries that start at or below lo.
+ *     Since each inner node records the lowest address of every child,
+ *     the entry before *pos, if any, is the predecessor of lo.
+ */
+static range_node_t *range_find(const range_set_t *ranges, const char *lo,
+                                 int *pos)
+{
+    range_node_t *n = ranges->root;
+    while (!n->leaf)
+    {
+        int i = range_pos(n, lo);
+        n = n->child[i > 0 ? i - 1 : 0];
+    }
+    *pos = range_pos(n, lo);
+    return n;
+}
+
+/*
+ * range_put - Put an entry at position pos of node n: a range [lo, hi]
+ *     in a leaf, or child in an inner node.  Returns the new right sibling
+ *     of n if n had to be split, or else NULL.
+ */
+static range_node_t *range_put(range_set_t *ranges, range_node_t *n, int pos,
+                               char *lo, char *hi, int index,
+                               range_node_t *child)
+{
+    range_node_t *right = NULL;
+    if (n->count == RANGE_FANOUT)
+    {
+        /* Move the upper half to a new right sibling */
+        int half = RANGE_FANOUT / 2;
+        right = range_node_new(ranges, n->leaf);
+        range_move(right, 0, n, half, RANGE_FANOUT - half);
+        right->count = RANGE_FANOUT - half;
+        n->count = half;
+        if (n->leaf)
+        {
+            right->next = n->next;
+            n->next = right;
+        }
+        if (pos > half)
+        {
+            n = right;
+            pos -= half;
+        }
+    }
+    range_move(n, pos + 1, n, pos, n->count - pos);
+    n->lo[pos] = lo;
+    if (n->leaf)
+    {
+        n->hi[pos] = hi;
+        n->index[pos] = index;
+    }
+    else
+        n->child[pos] = child;
+    n->count++;
+    return right;
+}
+
+/*
+ * range_insert - Insert range [lo, hi] into the subtree at n.  Returns the
+ *     new right sibling of n if n had to be split, or else NULL.
+ */
+static range_node_t *range_insert(range_set_t *ranges, range_node_t *n,
+                                  char *lo, char *hi, int index)
+{
+    int pos = range_pos(n, lo);
+    if (n->leaf)
+        return range_put(ranges, n, pos, lo, hi, index, NULL);
+    int i = pos > 0 ? pos - 1 : 0;
+    range_node_t *split = range_insert(ranges, n->child[i], lo, hi, index);
+    n->lo[i] = n->child[i]->lo[0];
+    if (!split)
+        return NULL;
+    return range_put(ranges, n, i + 1, split->lo[0], NULL, 0, split);
+}
+
+/*
+ * range_rebalance - Refill child i of inner node n, which has fallen below
+ *     half full, from a neighboring child, merging the two if the
+ *     neighbor has no entries to spare.
+ */
+static void range_rebalance(range_set_t *ranges, range_node_t *n, int i)
+{
+    int half = RANGE_FANOUT / 2;
+    if (i == n->count - 1)
+        i--; /* Work on children i and i + 1 */
+    range_node_t *left = n->child[i];
+    range_node_t *right = n->child[i + 1];
+    if (left->count + right->count <= RANGE_FANOUT)
+    {
+        range_move(left, left->count, right, 0, right->count);
+        left->count += right->count;
+        if (left->leaf)
+            left->next = right->next;
+        range_node_free(ranges, right);
+        range_move(n, i + 1, n, i + 2, n->count - i - 2);
+        n->count--;
+        return;
+    }
+    if (left->count < half)
+    {
+        int k = half - left->count;
+        range_move(left, left->count, right, 0, k);
+        left->count += k;
+        range_move(right, 0, right, k, right->count - k);
+        right->count -= k;
+    }
+    else
+    {
+        int k = half - right->count;
+        range_move(right, k, right, 0, right->count);
+        range_move(right, 0, left, left->count - k, k);
+        right->count += k;
+        left->count -= k;
+    }
+    n->lo[i + 1] = right->lo[0];
+}
+
+/*
+ * range_delete - Delete the range starting at lo from the subtree at n.
+ *     Returns false if there is no such range.
+ */
+static bool range_delete(range_set_t *ranges, range_node_t *n, char *lo)
+{
+    int pos = range_pos(n, lo);
+    if (pos == 0)
+        return false;
+    if (n->leaf)
+    {
+        if (n->lo[pos - 1] != lo)
+            return false;
+        range_move(n, pos - 1, n, pos, n->count - pos);
+        n->count--;
+        return true;
+    }
+    int i = pos - 1;
+    range_node_t *c = n->child[i];
+    if (!range_delete(ranges, c, lo))
+        return false;
+    if (c->count > 0)
+        n->lo[i] = c->lo[0];
+    if (c->count < RANGE_FANOUT / 2 && n->count > 1)
+        range_rebalance(ranges, n, i);
+    return true;
+}
+
 /*
  * new_range_set - Create an empty range set
  */
 static range_set_t *new_range_set()
 {
     range_set_t *ranges = (range_set_t *)malloc(sizeof(range_set_t));
-    ranges->list = NULL;
-    ranges->lo_tree = tree_new();
+    ranges->free_nodes = NULL;
+    ranges->chunks = NULL;
+    ranges->root = range_node_new(ranges, true);
     return ranges;
 }
 
 /*
  * add_range - As directed by request opnum in trace tracenum,
  *     we've just called the student's mm_malloc to allocate a block of
- *     size bytes at addr lo. After checking the block for correctness,
- *     we create a range struct for this block and add it to the range list.
+ *     size bytes at addr lo, which must be align-byte aligned. After
+ *     checking the block for correctness, we record its extent in the
+ *     range set.
  */
 static bool add_range(range_set_t *ranges, char *lo, size_t size,
-                      const trace_t *trace, int opnum, int index)
+                      size_t align, const trace_t *trace, int opnum,
+                      int index)
 {
     char *hi = lo + size - 1;
 
     assert(size > 0);
 
-    /* Payload addresses must be ALIGNMENT-byte aligned */
-    if (!IS_ALIGNED(lo))
+    /* Payload addresses must be ALIGNMENT-byte aligned, or more for
+     * memalign requests */
+    if (!IS_ALIGNED(lo, align))
     {
         malloc_error(trace, opnum,
-                     "Payload address (%p) not aligned to %d bytes", lo,
-                     ALIGNMENT);
+                     "Payload address (%p) not aligned to %zu bytes", lo,
+                     align);
         return false;
     }
 
-    /* The payload must lie within the extent of the heap */
-    if ((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
-        (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi()))
+    /* The payload must lie within the extent of the heap, or of one of the
+     * regions the allocator has mapped */
+    if (((lo < (char *)mem_heap_lo()) || (lo > (char *)mem_heap_hi()) ||
+         (hi < (char *)mem_heap_lo()) || (hi > (char *)mem_heap_hi())) &&
+        !mem_is_mapped(lo, hi))
     {
         malloc_error(trace, opnum, "Payload (%p:%p) lies outside heap (%p:%p)",
                      lo, hi, mem_heap_lo(), mem_heap_hi());
@@ -820,43 +1358,44 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
     if (debug_mode == DBG_NONE)
         return 1;
 
-    /* Look in the tree for the predecessor block */
-    range_t *prev = tree_find_nearest(ranges->lo_tree, (long unsigned)lo);
-    range_t *next = prev ? prev->next : NULL;
+    /* Look for the predecessor and successor blocks */
+    int pos;
+    range_node_t *leaf = range_find(ranges, lo, &pos);
     /* See if it overlaps previous or next blocks */
-    if (prev && lo <= prev->hi)
+    if (pos > 0 && lo <= leaf->hi[pos - 1])
     {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) overlaps another payload (%p:%p)\n", lo,
-                     hi, prev->lo, prev->hi);
+                     hi, leaf->lo[pos - 1], leaf->hi[pos - 1]);
         return false;
     }
-    if (next && hi >= next->lo)
+    if (pos == leaf->count)
+    {
+        leaf = leaf->next;
+        pos = 0;
+    }
+    if (leaf && hi >= leaf->lo[pos])
     {
         malloc_error(trace, opnum,
                      "Payload (%p:%p) overlaps another payload (%p:%p)\n", lo,
-                     hi, next->lo, next->hi);
+                     hi, leaf->lo[pos], leaf->hi[pos]);
         return false;
     }
     /*
      * Everything looks OK, so remember the extent of this block
-     * by creating a range struct and adding it the range list.
      */
-    range_t *p;
-    if ((p = (range_t *)malloc(sizeof(range_t))) == NULL)
-        unix_error("malloc error in add_range");
-    p->prev = prev;
-    if (prev)
-        prev->next = p;
-    else
-        ranges->list = p;
-    p->next = next;
-    if (next)
-        next->prev = p;
-    p->lo = lo;
-    p->hi = hi;
-    p->index = index;
-    tree_insert(ranges->lo_tree, (long unsigned)lo, (void *)p);
+    range_node_t *split = range_insert(ranges, ranges->root, lo, hi, index);
+    if (split)
+    {
+        /* Grow the tree by a level */
+        range_node_t *root = range_node_new(ranges, false);
+        root->lo[0] = ranges->root->lo[0];
+        root->child[0] = ranges->root;
+        root->lo[1] = split->lo[0];
+        root->child[1] = split;
+        root->count = 2;
+        ranges->root = root;
+    }
     return true;
 }
 
@@ -865,18 +1404,15 @@ static bool add_range(range_set_t *ranges, char *lo, size_t size,
  */
 static void remove_range(range_set_t *ranges, char *lo)
 {
-    range_t *p = (range_t *)tree_remove(ranges->lo_tree, (long unsigned)lo);
-    if (!p)
+    range_node_t *root = ranges->root;
+    if (!range_delete(ranges, root, lo))
         return;
-    range_t *prev = p->prev;
-    range_t *next = p->next;
-    if (prev)
-        prev->next = next;
-    else
-        ranges->list = next;
-    if (next)
-        next->prev = prev;
-    free(p);
+    if (!root->leaf && root->count == 1)
+    {
+        /* Shrink the tree by a level */
+        ranges->root = root->child[0];
+        range_node_free(ranges, root);
+    }
 }
 
 /*
@@ -884,7 +1420,12 @@ static void remove_range(range_set_t *ranges, char *lo)
  */
 static void free_range_set(range_set_t *ranges)
 {
-    tree_free(ranges->lo_tree, free);
+    while (ranges->chunks)
+    {
+        range_chunk_t *c = ranges->chunks;
+        ranges->chunks = c->next;
+        free(c);
+    }
     free(ranges);
 }
 
@@ -904,12 +1445,13 @@ static void init_random_data(void)
     {
         random_data[len] = random();
     }
+    memcpy(&random_data[RANDOM_DATA_LEN], random_data,
+           MAXFILL * sizeof(randint_t));
 }
 
 static void randomize_block(trace_t *traces, int index)
 {
     size_t size, fsize;
-    size_t i;
     randint_t *block;
     size_t base;
 
@@ -927,16 +1469,19 @@ static void randomize_block(trace_t *traces, int index)
         fsize = maxfill;
     base = traces->block_rand_base[index];
 
-    // NOTE: It's expensive to do this one byte at a time.
-
     // NOTE: It would be nice to also fill in at end of block, but
     // this gets messy with REALLOC
 
-    for (i = 0; i < fsize; i++)
-    {
-        mem_write(&block[i], random_data[(base + i) % RANDOM_DATA_LEN],
-                  sizeof(randint_t));
-    }
+    /*
+     * A plain memcpy lets libc pick the widest vector copy the CPU has.
+     * Emulated memory must go through memlib, a word at a time.
+     */
+    if (sparse_mode)
+        mem_memcpy(block, &random_data[base % RANDOM_DATA_LEN],
+                   fsize * sizeof(randint_t));
+    else
+        memcpy(block, &random_data[base % RANDOM_DATA_LEN],
+               fsize * sizeof(randint_t));
 
 #ifdef USE_MSAN
     /* Mark payload data as uninitialized */
@@ -950,6 +1495,7 @@ static bool check_index(const trace_t *trace, int opnum, int index)
     size_t i;
     randint_t *block;
     size_t base;
+    const randint_t *expect;
     int ngarbled = 0;
     size_t firstgarbled = (size_t)-1;
 
@@ -969,22 +1515,35 @@ static bool check_index(const trace_t *trace, int opnum, int index)
         fsize = thresh;
 
     base = trace->block_rand_base[index];
+    expect = &random_data[base % RANDOM_DATA_LEN];
 
 #ifdef USE_MSAN
     /* Mark memory as initialized so the following won't cause an error */
     __msan_unpoison(trace->blocks[index], trace->block_sizes[index]);
 #endif
 
-    // NOTE: It's expensive to do this one byte at a time.
+    /* Intact blocks, the usual case, pass a single vectorized memcmp */
+    if (!sparse_mode && memcmp(block, expect, fsize * sizeof(randint_t)) == 0)
+        return true;
+
+    /* Otherwise compare a word at a time, and then count garbled values */
     setUBCheck(false);
-    for (i = 0; i < fsize; i++)
+    for (i = 0; i < fsize; i += RANDOM_WORD)
     {
-        if (mem_read(&block[i], sizeof(randint_t)) !=
-            random_data[(base + i) % RANDOM_DATA_LEN])
+        size_t n = fsize - i < RANDOM_WORD ? fsize - i : RANDOM_WORD;
+        uint64_t want = 0;
+        memcpy(&want, &expect[i], n * sizeof(randint_t));
+        uint64_t diff =
+            mem_read(&block[i], n * sizeof(randint_t)) ^ want;
+        size_t j;
+        for (j = 0; diff != 0 && j < n; j++)
         {
-            if (firstgarbled == (size_t)-1)
-                firstgarbled = i;
-            ngarbled++;
+            if ((randint_t)(diff >> (8 * sizeof(randint_t) * j)) != 0)
+            {
+                if (firstgarbled == (size_t)-1)
+                    firstgarbled = i + j;
+                ngarbled++;
+            }
         }
     }
     setUBCheck(true);
@@ -1006,51 +1565,33 @@ static bool check_index(const trace_t *trace, int opnum, int index)
  *********************************************/
 
 /*
- * read_trace - read a trace file and store it in memory
+ * binary_trace_name - the name of the binary trace for the trace file
+ *     name: name itself if it ends in .rtb, else name with its .rep
+ *     suffix (if any) replaced by .rtb
  */
-static trace_t *read_trace(stats_t *stats, const char *tracedir,
-                           const char *filename)
+static void binary_trace_name(char *binname, const char *name)
 {
-    FILE *tracefile;
-    trace_t *trace;
-    char type[MAXLINE];
-    int index;
-    size_t size;
-    int max_index = 0;
-    int op_index;
-    int ignore = 0;
-
-    if (verbose > 1)
-        printf("Reading tracefile: %s\n", filename);
-
-    /* Allocate the trace record */
-    if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
-        unix_error("malloc 1 failed in read_trace");
-
-    /* Read the trace file header */
-    strcpy(trace->filename, tracedir);
-    strcat(trace->filename, filename);
-    if ((tracefile = fopen(trace->filename, "r")) == NULL)
-    {
-        unix_error("Could not open %s in read_trace", trace->filename);
-    }
-    int iweight;
-    ignore += fscanf(tracefile, "%d", &iweight);
-    trace->weight = iweight;
-    ignore += fscanf(tracefile, "%d", &trace->num_ids);
-    ignore += fscanf(tracefile, "%d", &trace->num_ops);
-    ignore += fscanf(tracefile, "%zd", &trace->data_bytes);
+    size_t len = strlen(name);
 
-    if (trace->weight > 3)
+    if (len >= 4 && strcmp(name + len - 4, ".rtb") == 0)
     {
-        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+        strcpy(binname, name);
+        return;
     }
+    if (len >= 4 && strcmp(name + len - 4, ".rep") == 0)
+        len -= 4;
+    if (len + 5 > MAXLINE)
+        app_error("%s: trace file name is too long\n", name);
+    memcpy(binname, name, len);
+    strcpy(binname + len, ".rtb");
+}
 
-    /* We'll store each request line in the trace in this array */
-    if ((trace->ops =
-             (traceop_t *)malloc(trace->num_ops * sizeof(traceop_t))) == NULL)
-        unix_error("malloc 2 failed in read_trace");
-
+/*
+ * alloc_trace_arrays - allocate the per-id arrays of a trace whose
+ *     num_ids is known
+ */
+static void alloc_trace_arrays(trace_t *trace)
+{
     /* We'll keep an array of pointers to the allocated blocks here... */
     if ((trace->blocks = (char **)calloc(trace->num_ids, sizeof(char *))) ==
         NULL)
@@ -1065,26 +1606,184 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     if ((trace->block_rand_base =
              calloc(trace->num_ids, sizeof(*trace->block_rand_base))) == NULL)
         unix_error("malloc 5 failed in read_trace");
+}
 
-    /* read every request line in the trace file */
-    index = 0;
-    op_index = 0;
-    while (fscanf(tracefile, "%s", type) != EOF)
-    {
-        switch (type[0])
-        {
-        case 'a':
-            ignore += fscanf(tracefile, "%u %lu", &index, &size);
-            trace->ops[op_index].type = ALLOC;
+/*
+ * map_trace - map the binary trace of trace->filename, if there is one
+ *     that is at least as new as the text trace, and point trace->ops
+ *     into it.  Returns false if the text trace should be read instead.
+ */
+static bool map_trace(trace_t *trace)
+{
+    char binname[MAXLINE];
+    struct stat text_st, bin_st;
+    int fd;
+    void *map;
+    const trace_header_t *header;
+    int i;
+
+    binary_trace_name(binname, trace->filename);
+    if (strcmp(binname, trace->filename) != 0 &&
+        (stat(binname, &bin_st) < 0 ||
+         (stat(trace->filename, &text_st) == 0 &&
+          bin_st.st_mtime < text_st.st_mtime)))
+        return false;
+
+    if (verbose > 1)
+        printf("Mapping binary trace: %s\n", binname);
+    if ((fd = open(binname, O_RDONLY)) < 0)
+        unix_error("Could not open %s in read_trace", binname);
+    if (fstat(fd, &bin_st) < 0)
+        unix_error("fstat failed in read_trace");
+    if ((size_t)bin_st.st_size < sizeof(trace_header_t))
+        app_error("%s: truncated binary trace\n", binname);
+    map = mmap(NULL, (size_t)bin_st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (map == MAP_FAILED)
+        unix_error("mmap failed in read_trace");
+    close(fd);
+
+    header = (const trace_header_t *)map;
+    if (memcmp(header->magic, TRACE_MAGIC, sizeof(header->magic)) != 0 ||
+        header->op_size != sizeof(traceop_t) || header->num_ops < 0 ||
+        header->num_ids < 1 ||
+        (size_t)bin_st.st_size !=
+            sizeof(*header) + (size_t)header->num_ops * sizeof(traceop_t))
+    {
+        app_error("%s: not a binary trace written by this driver; "
+                  "rerun mdriver -B\n",
+                  binname);
+    }
+    if (header->weight < 0 || header->weight > 3)
+    {
+        app_error("%s: weight can only be in {0, 1, 2 3}\n", binname);
+    }
+
+    trace->weight = (weight_t)header->weight;
+    trace->num_ids = header->num_ids;
+    trace->num_ops = header->num_ops;
+    trace->num_calls = header->num_calls;
+    trace->data_bytes = header->data_bytes;
+    trace->ops = (traceop_t *)(header + 1);
+    trace->map_bytes = (size_t)bin_st.st_size;
+
+    /* the records are used in place, but a bad id must not index past
+     * the per-id arrays */
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        const traceop_t *op = &trace->ops[i];
+        int last = op->index;
+        if (op->type == ALLOC_BATCH || op->type == FREE_BATCH)
+            last += op->count - 1;
+        if (op->type > FREE_BATCH || op->index < -1 ||
+            (op->index < 0 && op->type != FREE) || last < op->index ||
+            last >= trace->num_ids)
+        {
+            app_error("%s: bad request %d in binary trace\n", binname, i);
+        }
+        if (op->type == MEMALIGN &&
+            (op->align < ALIGNMENT || (op->align & (op->align - 1)) != 0))
+        {
+            app_error("%s: memalign alignment %zu of request %d is not a "
+                      "power of two of at least %d\n",
+                      binname, op->align, i, ALIGNMENT);
+        }
+    }
+
+    alloc_trace_arrays(trace);
+    return true;
+}
+
+/*
+ * check_trace_id - reject an id outside the trace's declared id range
+ *     before it indexes the per-id arrays
+ */
+static void check_trace_id(const trace_t *trace, int index)
+{
+    if (index < 0 || index >= trace->num_ids)
+    {
+        app_error("%s: id %d is out of range\n", trace->filename, index);
+    }
+}
+
+/*
+ * read_trace - read a trace file and store it in memory, mapping its
+ *     binary form instead if it has an up-to-date one
+ */
+static trace_t *read_trace(stats_t *stats, const char *tracedir,
+                           const char *filename)
+{
+    FILE *tracefile;
+    trace_t *trace;
+    char type[MAXLINE];
+    int index, count;
+    size_t size, align;
+    int max_index = 0;
+    int op_index;
+    int ignore = 0;
+
+    if (verbose > 1)
+        printf("Reading tracefile: %s\n", filename);
+
+    /* Allocate the trace record */
+    if ((trace = (trace_t *)malloc(sizeof(trace_t))) == NULL)
+        unix_error("malloc 1 failed in read_trace");
+
+    strcpy(trace->filename, tracedir);
+    strcat(trace->filename, filename);
+    trace->map_bytes = 0;
+    if (!convert_flag && map_trace(trace))
+        goto done;
+
+    /* Read the trace file header */
+    if ((tracefile = fopen(trace->filename, "r")) == NULL)
+    {
+        unix_error("Could not open %s in read_trace", trace->filename);
+    }
+    int iweight;
+    ignore += fscanf(tracefile, "%d", &iweight);
+    trace->weight = iweight;
+    ignore += fscanf(tracefile, "%d", &trace->num_ids);
+    ignore += fscanf(tracefile, "%d", &trace->num_ops);
+    ignore += fscanf(tracefile, "%zd", &trace->data_bytes);
+
+    if (trace->weight > 3)
+    {
+        app_error("%s: weight can only be in {0, 1, 2 3}", trace->filename);
+    }
+
+    /* We'll store each request line in the trace in this array, zeroed
+     * so that unused fields are written out to binary traces as zeros */
+    if ((trace->ops =
+             (traceop_t *)calloc(trace->num_ops, sizeof(traceop_t))) == NULL)
+        unix_error("malloc 2 failed in read_trace");
+
+    alloc_trace_arrays(trace);
+
+    /* read every request line in the trace file; block_sizes tracks the size
+     * of each id so that sized frees know it */
+    index = 0;
+    op_index = 0;
+    trace->num_calls = 0;
+    while (fscanf(tracefile, "%s", type) != EOF)
+    {
+        switch (type[0])
+        {
+        case 'a':
+            ignore += fscanf(tracefile, "%u %lu", &index, &size);
+            check_trace_id(trace, index);
+            trace->ops[op_index].type = ALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
+            trace->block_sizes[index] = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'r':
             ignore += fscanf(tracefile, "%u %lu", &index, &size);
+            check_trace_id(trace, index);
             trace->ops[op_index].type = REALLOC;
             trace->ops[op_index].index = index;
             trace->ops[op_index].size = size;
+            trace->block_sizes[index] = size;
             max_index = (index > max_index) ? index : max_index;
             break;
         case 'f':
@@ -1092,11 +1791,62 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
             trace->ops[op_index].type = FREE;
             trace->ops[op_index].index = index;
             break;
+        case 'm':
+            ignore += fscanf(tracefile, "%u %lu %lu", &index, &align, &size);
+            check_trace_id(trace, index);
+            if (align < ALIGNMENT || (align & (align - 1)) != 0)
+            {
+                app_error("%s: memalign alignment %zu is not a power of two "
+                          "of at least %d\n",
+                          trace->filename, align, ALIGNMENT);
+            }
+            trace->ops[op_index].type = MEMALIGN;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = size;
+            trace->ops[op_index].align = align;
+            trace->block_sizes[index] = size;
+            max_index = (index > max_index) ? index : max_index;
+            break;
+        case 's':
+            ignore += fscanf(tracefile, "%u", &index);
+            check_trace_id(trace, index);
+            trace->ops[op_index].type = FREE_SIZED;
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].size = trace->block_sizes[index];
+            break;
+        case 'b':
+        case 'B':
+            if (type[0] == 'b')
+            {
+                ignore += fscanf(tracefile, "%u %u %lu", &index, &count, &size);
+                trace->ops[op_index].type = ALLOC_BATCH;
+            }
+            else
+            {
+                ignore += fscanf(tracefile, "%u %u", &index, &count);
+                trace->ops[op_index].type = FREE_BATCH;
+                size = 0;
+            }
+            if (count < 1 || index + count > trace->num_ids)
+            {
+                app_error("%s: batch of %d ids from %d is out of range\n",
+                          trace->filename, count, index);
+            }
+            trace->ops[op_index].index = index;
+            trace->ops[op_index].count = count;
+            trace->ops[op_index].size = size;
+            for (int j = index; j < index + count && type[0] == 'b'; j++)
+                trace->block_sizes[j] = size;
+            trace->num_calls += count - 1;
+            max_index = (index + count - 1 > max_index) ? index + count - 1
+                                                        : max_index;
+            break;
         default:
             app_error("Bogus type character (%c) in tracefile %s\n", type[0],
                       trace->filename);
         }
         op_index++;
+        trace->num_calls++;
         if (op_index == trace->num_ops)
             break;
     }
@@ -1104,10 +1854,11 @@ static trace_t *read_trace(stats_t *stats, const char *tracedir,
     assert(max_index == trace->num_ids - 1);
     assert(trace->num_ops == op_index);
 
+done:
     /* fill in the stats */
     strcpy(stats->filename, trace->filename);
     stats->weight = trace->weight;
-    stats->ops = trace->num_ops;
+    stats->ops = trace->num_calls;
 
     return trace;
 }
@@ -1124,29 +1875,122 @@ static void reinit_trace(trace_t *trace)
 
 /*
  * free_trace - Free the trace record and the four arrays it points
- *              to, all of which were allocated in read_trace().
+ *              to, all of which were allocated (or, for a binary
+ *              trace, the requests mapped) in read_trace().
  */
 static void free_trace(trace_t *trace)
 {
-    free(trace->ops); /* free the three arrays... */
+    if (trace->map_bytes > 0) /* unmap or free the requests... */
+        munmap((char *)trace->ops - sizeof(trace_header_t), trace->map_bytes);
+    else
+        free(trace->ops);
     free(trace->blocks);
     free(trace->block_sizes);
     free(trace->block_rand_base);
     free(trace); /* and the trace record itself... */
 }
 
+/*
+ * convert_trace - write the text trace filename in tracedir out as a
+ *     binary trace next to it
+ */
+static void convert_trace(const char *tracedir, const char *filename)
+{
+    stats_t stats;
+    trace_t *trace = read_trace(&stats, tracedir, filename);
+    char binname[MAXLINE];
+    trace_header_t header;
+    FILE *binfile;
+
+    binary_trace_name(binname, trace->filename);
+    if (strcmp(binname, trace->filename) == 0)
+        app_error("%s is already a binary trace\n", trace->filename);
+
+    memset(&header, 0, sizeof(header));
+    memcpy(header.magic, TRACE_MAGIC, sizeof(header.magic));
+    header.op_size = sizeof(traceop_t);
+    header.weight = trace->weight;
+    header.num_ids = trace->num_ids;
+    header.num_ops = trace->num_ops;
+    header.num_calls = trace->num_calls;
+    header.data_bytes = trace->data_bytes;
+
+    if ((binfile = fopen(binname, "wb")) == NULL)
+        unix_error("Could not create %s in convert_trace", binname);
+    if (fwrite(&header, sizeof(header), 1, binfile) != 1 ||
+        fwrite(trace->ops, sizeof(traceop_t), (size_t)trace->num_ops,
+               binfile) != (size_t)trace->num_ops ||
+        fclose(binfile) != 0)
+        unix_error("Could not write %s in convert_trace", binname);
+
+    if (verbose > 0)
+        printf("%s: %d requests\n", binname, trace->num_ops);
+    free_trace(trace);
+}
+
 /**********************************************************************
  * The following functions evaluate the correctness, space utilization,
  * and throughput of the libc and mm malloc packages.
  **********************************************************************/
 
+/*
+ * call_memalign - Serve a memalign request with the student's mm_memalign.
+ *     The reference allocators have none, so their drivers reject traces
+ *     that use it.
+ */
+static void *call_memalign(size_t align, size_t size)
+{
+#if REF_ONLY
+    app_error("memalign requests need an allocator with mm_memalign");
+#else
+    return mm_memalign(align, size);
+#endif
+}
+
+/*
+ * call_free_sized, call_malloc_batch, call_free_batch - Serve sized frees
+ *     and batch requests with the student's entry points. The reference
+ *     allocators have none, so their drivers fall back to one mm_free or
+ *     mm_malloc per block.
+ */
+static void call_free_sized(void *ptr, size_t size)
+{
+#if REF_ONLY
+    mm_free(ptr);
+#else
+    mm_free_sized(ptr, size);
+#endif
+}
+
+static size_t call_malloc_batch(size_t size, size_t n, char **out)
+{
+#if REF_ONLY
+    size_t i;
+    for (i = 0; i < n && (out[i] = mm_malloc(size)) != NULL; i++)
+        ;
+    return i;
+#else
+    return mm_malloc_batch(size, n, (void **)out);
+#endif
+}
+
+static void call_free_batch(char **ptrs, size_t n)
+{
+#if REF_ONLY
+    for (size_t i = 0; i < n; i++)
+        mm_free(ptrs[i]);
+#else
+    mm_free_batch((void **)ptrs, n);
+#endif
+}
+
 /*
  * eval_mm_valid - Check the mm malloc package for correctness
  */
 static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 {
-    int i;
-    int index;
+    int i, j;
+    int index, count;
     size_t size;
     char *newp;
     char *oldp;
@@ -1172,7 +2016,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
 
         if (debug_mode == DBG_EXPENSIVE)
         {
-            range_t *r;
+            range_node_t *r;
 
             /* Let the students check their own heap */
             if (!mm_checkheap(0))
@@ -1182,14 +2026,18 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             };
 
             /* Now check that all our allocated blocks have the right data */
-            r = ranges->list;
-            while (r)
+            r = ranges->root;
+            while (!r->leaf)
+                r = r->child[0];
+            for (; r; r = r->next)
             {
-                if (!check_index(trace, i, r->index))
+                for (j = 0; j < r->count; j++)
                 {
-                    allCheck = false;
+                    if (!check_index(trace, i, r->index[j]))
+                    {
+                        allCheck = false;
+                    }
                 }
-                r = r->next;
             }
         }
 
@@ -1210,7 +2058,7 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
              * to the range list if OK. The block must be  be aligned properly,
              * and must not overlap any currently allocated block.
              */
-            if (add_range(ranges, p, size, trace, i, index) == 0)
+            if (add_range(ranges, p, size, ALIGNMENT, trace, i, index) == 0)
                 return false;
 
             /* Remember region */
@@ -1221,6 +2069,23 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             randomize_block(trace, index);
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            if ((p = call_memalign(trace->ops[i].align, size)) == NULL)
+            {
+                malloc_error(trace, i, "mm_memalign failed.");
+                return false;
+            }
+
+            /* The payload must also be aligned as requested */
+            if (add_range(ranges, p, size, trace->ops[i].align, trace, i,
+                          index) == 0)
+                return false;
+
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+            randomize_block(trace, index);
+            break;
+
         case REALLOC: /* mm_realloc */
             if (!check_index(trace, i, index))
             {
@@ -1251,7 +2116,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             /* Check new block for correctness and add it to range list */
             if (size > 0)
             {
-                if (add_range(ranges, newp, size, trace, i, index) == 0)
+                if (add_range(ranges, newp, size, ALIGNMENT, trace, i,
+                              index) == 0)
                     return false;
             }
 
@@ -1294,6 +2160,49 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
             mm_free(p);
             break;
 
+        case FREE_SIZED: /* mm_free_sized */
+            if (!check_index(trace, i, index))
+            {
+                allCheck = false;
+            }
+            p = trace->blocks[index];
+            remove_range(ranges, p);
+            call_free_sized(p, trace->block_sizes[index]);
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            count = trace->ops[i].count;
+            if (call_malloc_batch(size, count, &trace->blocks[index]) !=
+                (size_t)count)
+            {
+                malloc_error(trace, i, "mm_malloc_batch failed.");
+                return false;
+            }
+
+            /* Each block is checked and remembered as if malloc'ed alone */
+            for (j = index; j < index + count; j++)
+            {
+                if (add_range(ranges, trace->blocks[j], size, ALIGNMENT, trace,
+                              i, j) == 0)
+                    return false;
+                trace->block_sizes[j] = size;
+                randomize_block(trace, j);
+            }
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            count = trace->ops[i].count;
+            for (j = index; j < index + count; j++)
+            {
+                if (!check_index(trace, i, j))
+                {
+                    allCheck = false;
+                }
+                remove_range(ranges, trace->blocks[j]);
+            }
+            call_free_batch(&trace->blocks[index], count);
+            break;
+
         default:
             app_error("Nonexistent request type in eval_mm_valid");
         }
@@ -1316,8 +2225,8 @@ static bool eval_mm_valid(trace_t *trace, range_set_t *ranges)
  */
 static double eval_mm_util(trace_t *trace, int tracenum)
 {
-    int i;
-    int index;
+    int i, j;
+    int index, count;
     size_t size, newsize, oldsize;
     size_t max_total_size = 0;
     size_t total_size = 0;
@@ -1353,6 +2262,22 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size += size;
             break;
 
+        case MEMALIGN: /* mm_memalign */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+
+            if ((p = call_memalign(trace->ops[i].align, size)) == NULL)
+            {
+                app_error("trace %d: mm_memalign failed in eval_mm_util",
+                          tracenum);
+            }
+
+            trace->blocks[index] = p;
+            trace->block_sizes[index] = size;
+
+            total_size += size;
+            break;
+
         case REALLOC: /* mm_realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1392,6 +2317,44 @@ static double eval_mm_util(trace_t *trace, int tracenum)
             total_size -= size;
             break;
 
+        case FREE_SIZED: /* mm_free_sized */
+            index = trace->ops[i].index;
+            size = trace->block_sizes[index];
+            call_free_sized(trace->blocks[index], size);
+
+            total_size -= size;
+            break;
+
+        case ALLOC_BATCH: /* mm_malloc_batch */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            count = trace->ops[i].count;
+
+            if (call_malloc_batch(size, count, &trace->blocks[index]) !=
+                (size_t)count)
+            {
+                app_error("trace %d: mm_malloc_batch failed in eval_mm_util",
+                          tracenum);
+            }
+            for (j = index; j < index + count; j++)
+            {
+                trace->block_sizes[j] = size;
+            }
+
+            total_size += size * count;
+            break;
+
+        case FREE_BATCH: /* mm_free_batch */
+            index = trace->ops[i].index;
+            count = trace->ops[i].count;
+            call_free_batch(&trace->blocks[index], count);
+
+            for (j = index; j < index + count; j++)
+            {
+                total_size -= trace->block_sizes[j];
+            }
+            break;
+
         default:
             app_error("trace %d: Nonexistent request type in eval_mm_util",
                       tracenum);
@@ -1406,7 +2369,188 @@ static double eval_mm_util(trace_t *trace, int tracenum)
     printf(".");
 #endif
 
-    return ((double)max_total_size / (double)mem_heapsize());
+    /* The allocator may have trimmed the heap since its peak; memory in
+     * mapped regions counts toward the footprint too */
+    return ((double)max_total_size / (double)mem_peak_heapsize());
+}
+
+/*
+ * lat_bucket - the histogram bucket of a latency of ticks
+ */
+static int lat_bucket(unsigned long long ticks)
+{
+    int high, sub;
+
+    if (ticks < (1ULL << LAT_SUB_BITS))
+        return (int)ticks;
+    high = 63 - __builtin_clzll(ticks);
+    sub = (int)(ticks >> (high - LAT_SUB_BITS)) & ((1 << LAT_SUB_BITS) - 1);
+    return ((high - LAT_SUB_BITS + 1) << LAT_SUB_BITS) + sub;
+}
+
+/*
+ * lat_bucket_top - the largest latency that falls in bucket
+ */
+static unsigned long long lat_bucket_top(int bucket)
+{
+    int high, sub;
+
+    if (bucket < (1 << LAT_SUB_BITS))
+        return (unsigned long long)bucket;
+    high = (bucket >> LAT_SUB_BITS) + LAT_SUB_BITS - 1;
+    sub = bucket & ((1 << LAT_SUB_BITS) - 1);
+    return ((((1ULL << LAT_SUB_BITS) + sub + 1) << (high - LAT_SUB_BITS)) - 1);
+}
+
+/*
+ * note_slowest - keep op among the slowest requests of lat if it is
+ */
+static void note_slowest(latency_t *lat, const traceop_t *op,
+                         unsigned long long ticks)
+{
+    int i;
+
+    if (ticks <= lat->slowest[LAT_SLOWEST - 1].ticks)
+        return;
+    for (i = LAT_SLOWEST - 1; i > 0 && ticks > lat->slowest[i - 1].ticks; i--)
+        lat->slowest[i] = lat->slowest[i - 1];
+    lat->slowest[i].op = *op;
+    lat->slowest[i].ticks = ticks;
+}
+
+/*
+ * add_latency - count a request that took ticks into lat
+ */
+static void add_latency(latency_t *lat, const traceop_t *op,
+                        unsigned long long ticks)
+{
+    lat_hist_t *hist = &lat->hist[op->type];
+
+    hist->count++;
+    hist->bucket[lat_bucket(ticks)]++;
+    if (ticks > hist->max)
+        hist->max = ticks;
+    note_slowest(lat, op, ticks);
+}
+
+/*
+ * merge_latency - add the requests timed in from into to
+ */
+static void merge_latency(latency_t *to, const latency_t *from)
+{
+    int type, b, i;
+
+    for (type = 0; type <= FREE_BATCH; type++)
+    {
+        lat_hist_t *hist = &to->hist[type];
+        hist->count += from->hist[type].count;
+        if (from->hist[type].max > hist->max)
+            hist->max = from->hist[type].max;
+        for (b = 0; b < LAT_BUCKETS; b++)
+            hist->bucket[b] += from->hist[type].bucket[b];
+    }
+    for (i = 0; i < LAT_SLOWEST && from->slowest[i].ticks > 0; i++)
+        note_slowest(to, &from->slowest[i].op, from->slowest[i].ticks);
+}
+
+/*
+ * replay_op - issue one trace request to the mm malloc package, keeping
+ *    the pointers it returns in blocks
+ */
+static inline void replay_op(const traceop_t *op, char **blocks)
+{
+    int index;
+    size_t size, newsize;
+    char *p, *newp, *oldp, *block;
+
+    switch (op->type)
+    {
+
+    case ALLOC: /* mm_malloc */
+        index = op->index;
+        size = op->size;
+        if ((p = mm_malloc(size)) == NULL)
+            app_error("mm_malloc error in replay_op");
+        blocks[index] = p;
+        break;
+
+    case MEMALIGN: /* mm_memalign */
+        index = op->index;
+        size = op->size;
+        if ((p = call_memalign(op->align, size)) == NULL)
+            app_error("mm_memalign error in replay_op");
+        blocks[index] = p;
+        break;
+
+    case REALLOC: /* mm_realloc */
+        index = op->index;
+        newsize = op->size;
+        oldp = blocks[index];
+        setUBCheck(false);
+        if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
+            app_error("mm_realloc error in replay_op");
+        setUBCheck(true);
+        blocks[index] = newp;
+        break;
+
+    case FREE: /* mm_free */
+        index = op->index;
+        if (index < 0)
+        {
+            block = 0;
+        }
+        else
+        {
+            block = blocks[index];
+        }
+        mm_free(block);
+        break;
+
+    case FREE_SIZED: /* mm_free_sized */
+        index = op->index;
+        call_free_sized(blocks[index], op->size);
+        break;
+
+    case ALLOC_BATCH: /* mm_malloc_batch */
+        index = op->index;
+        if (call_malloc_batch(op->size, op->count, &blocks[index]) !=
+            (size_t)op->count)
+            app_error("mm_malloc_batch error in replay_op");
+        break;
+
+    case FREE_BATCH: /* mm_free_batch */
+        index = op->index;
+        call_free_batch(&blocks[index], op->count);
+        break;
+
+    default:
+        app_error("Nonexistent request type in replay_op");
+    }
+}
+
+/*
+ * replay_mm - issue the requests ops[0..num_ops-1] to the mm malloc
+ *    package, keeping the pointers it returns in blocks, and timing each
+ *    one into lat unless it is NULL
+ */
+static void replay_mm(const traceop_t *ops, int num_ops, char **blocks,
+                      latency_t *lat)
+{
+    int i;
+
+    if (lat == NULL)
+    {
+        for (i = 0; i < num_ops; i++)
+            replay_op(&ops[i], blocks);
+        return;
+    }
+
+    for (i = 0; i < num_ops; i++)
+    {
+        unsigned long long start = read_ticks();
+        replay_op(&ops[i], blocks);
+        add_latency(lat, &ops[i], read_ticks() - start);
+    }
 }
 
 /*
@@ -1415,9 +2559,6 @@ static double eval_mm_util(trace_t *trace, int tracenum)
  */
 static void eval_mm_speed(void *ptr)
 {
-    int i, index;
-    size_t size, newsize;
-    char *p, *newp, *oldp, *block;
     trace_t *trace = ((speed_t *)ptr)->trace;
     reinit_trace(trace);
 
@@ -1426,47 +2567,348 @@ static void eval_mm_speed(void *ptr)
     if (!mm_init())
         app_error("mm_init failed in eval_mm_speed");
 
-    /* Interpret each trace request */
+    replay_mm(trace->ops, trace->num_ops, trace->blocks,
+              ((speed_t *)ptr)->lat);
+}
+
+#if MT_MODE
+/*
+ * split_trace - divide the requests of trace among nthreads threads.  With
+ *    -R each thread gets all of them; otherwise each id, or each batch of
+ *    ids, goes to the next thread round robin when it first appears, and
+ *    its later requests follow it there.
+ */
+static mt_part_t *split_trace(const trace_t *trace, int nthreads)
+{
+    mt_part_t *parts;
+    int *owner = NULL;
+    int i, j, t, next = 0;
+
+    if ((parts = calloc(nthreads, sizeof(*parts))) == NULL)
+        unix_error("calloc failed in split_trace");
+    for (t = 0; t < nthreads; t++)
+        if ((parts[t].blocks = calloc(trace->num_ids, sizeof(char *))) == NULL)
+            unix_error("calloc failed in split_trace");
+
+    if (mt_copies)
+    {
+        for (t = 0; t < nthreads; t++)
+        {
+            parts[t].ops = trace->ops;
+            parts[t].num_ops = trace->num_ops;
+            parts[t].num_calls = trace->num_calls;
+        }
+        return parts;
+    }
+
+    if ((owner = malloc(trace->num_ids * sizeof(*owner))) == NULL)
+        unix_error("malloc failed in split_trace");
+    for (i = 0; i < trace->num_ids; i++)
+        owner[i] = -1;
+
+    /* find each request's thread, counting how many each thread gets */
+    int *thread_of;
+    if ((thread_of = malloc(trace->num_ops * sizeof(*thread_of))) == NULL)
+        unix_error("malloc failed in split_trace");
     for (i = 0; i < trace->num_ops; i++)
-        switch (trace->ops[i].type)
+    {
+        const traceop_t *op = &trace->ops[i];
+        int count = (op->type == ALLOC_BATCH || op->type == FREE_BATCH)
+                        ? op->count
+                        : 1;
+        if (op->index < 0)
         {
+            t = 0; /* free(NULL) */
+        }
+        else
+        {
+            t = owner[op->index] >= 0 ? owner[op->index] : next++ % nthreads;
+            for (j = op->index; j < op->index + count; j++)
+            {
+                if (owner[j] < 0)
+                    owner[j] = t;
+                else if (owner[j] != t)
+                    app_error("%s: batch at request %d mixes ids of "
+                              "different threads\n",
+                              trace->filename, i);
+            }
+        }
+        thread_of[i] = t;
+        parts[t].num_ops++;
+        parts[t].num_calls += count;
+    }
 
-        case ALLOC: /* mm_malloc */
-            index = trace->ops[i].index;
-            size = trace->ops[i].size;
-            if ((p = mm_malloc(size)) == NULL)
-                app_error("mm_malloc error in eval_mm_speed");
-            trace->blocks[index] = p;
-            break;
+    for (t = 0; t < nthreads; t++)
+    {
+        if ((parts[t].ops = malloc((parts[t].num_ops + 1) *
+                                   sizeof(traceop_t))) == NULL)
+            unix_error("malloc failed in split_trace");
+        parts[t].num_ops = 0;
+    }
+    for (i = 0; i < trace->num_ops; i++)
+    {
+        mt_part_t *part = &parts[thread_of[i]];
+        part->ops[part->num_ops++] = trace->ops[i];
+    }
 
-        case REALLOC: /* mm_realloc */
-            index = trace->ops[i].index;
-            newsize = trace->ops[i].size;
-            oldp = trace->blocks[index];
-            setUBCheck(false);
-            if ((newp = mm_realloc(oldp, newsize)) == NULL && newsize != 0)
-                app_error("mm_realloc error in eval_mm_speed");
-            setUBCheck(true);
-            trace->blocks[index] = newp;
+    free(thread_of);
+    free(owner);
+    return parts;
+}
+
+/*
+ * free_parts - free what split_trace allocated
+ */
+static void free_parts(mt_part_t *parts, int nthreads)
+{
+    for (int t = 0; t < nthreads; t++)
+    {
+        if (!mt_copies)
+            free(parts[t].ops);
+        free(parts[t].blocks);
+    }
+    free(parts);
+}
+
+/* Holds the threads of a multithreaded run until all of them exist */
+static pthread_barrier_t mt_barrier;
+
+/*
+ * mt_replay - body of one thread of a multithreaded speed run
+ */
+static void *mt_replay(void *ptr)
+{
+    mt_part_t *part = (mt_part_t *)ptr;
+    struct timespec start, end;
+
+    pthread_barrier_wait(&mt_barrier);
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    replay_mm(part->ops, part->num_ops, part->blocks, part->lat);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double secs = (double)(end.tv_sec - start.tv_sec) +
+                  (double)(end.tv_nsec - start.tv_nsec) / 1e9;
+    if (part->secs == 0 || secs < part->secs)
+        part->secs = secs;
+    return NULL;
+}
+
+/*
+ * eval_mm_mt_speed - This is the function that is used by fcyc()
+ *    to measure the running time of the mm malloc package when
+ *    mt_threads threads issue the requests at the same time.
+ */
+static void eval_mm_mt_speed(void *ptr)
+{
+    speed_t *speed_params = (speed_t *)ptr;
+    trace_t *trace = speed_params->trace;
+    pthread_t tids[mt_threads];
+    int t;
+
+    /* Reset the heap and initialize the mm package */
+    mem_reset_brk();
+    if (!mm_init())
+        app_error("mm_init failed in eval_mm_mt_speed");
+
+    pthread_barrier_init(&mt_barrier, NULL, mt_threads);
+    for (t = 0; t < mt_threads; t++)
+    {
+        mt_part_t *part = &speed_params->parts[t];
+        memset(part->blocks, 0, trace->num_ids * sizeof(char *));
+        if (pthread_create(&tids[t], NULL, mt_replay, part) != 0)
+            unix_error("pthread_create failed in eval_mm_mt_speed");
+    }
+    for (t = 0; t < mt_threads; t++)
+        pthread_join(tids[t], NULL);
+    pthread_barrier_destroy(&mt_barrier);
+}
+
+/*
+ * time_mm_mt_speed - time the trace on mt_threads threads, counting the
+ *    requests of all of them toward stats->ops, and print how fast each
+ *    thread issued its own requests
+ */
+static double time_mm_mt_speed(stats_t *stats, speed_t *speed_params)
+{
+    trace_t *trace = speed_params->trace;
+    mt_part_t *parts = split_trace(trace, mt_threads);
+    double secs, min_ns = DBL_MAX, max_ns = 0, sum_ns = 0;
+    int t;
+
+    speed_params->parts = parts;
+    secs = fsec(eval_mm_mt_speed, speed_params);
+    speed_params->parts = NULL;
+
+    stats->ops = 0;
+    for (t = 0; t < mt_threads; t++)
+    {
+        double ns = parts[t].num_calls > 0
+                        ? parts[t].secs * 1e9 / parts[t].num_calls
+                        : 0;
+        stats->ops += parts[t].num_calls;
+        min_ns = ns < min_ns ? ns : min_ns;
+        max_ns = ns > max_ns ? ns : max_ns;
+        sum_ns += ns;
+        if (verbose > 1)
+            printf("  thread %d: %d ops in %.3f ms, %.1f ns/op\n", t,
+                   parts[t].num_calls, parts[t].secs * 1e3, ns);
+    }
+    if (verbose > 0)
+        printf("%s: %d threads, %.0f Kops/sec; per-thread ns/op "
+               "min %.1f mean %.1f max %.1f\n",
+               trace->filename, mt_threads, stats->ops / (secs * 1000.0),
+               min_ns, sum_ns / mt_threads, max_ns);
+
+    free_parts(parts, mt_threads);
+    return secs;
+}
+#endif /* MT_MODE */
+
+#if !REF_ONLY
+/* Names of the request types in latency reports */
+static const char *op_names[FREE_BATCH + 1] = {
+    "malloc", "free", "realloc", "memalign", "free_sized", "malloc_batch",
+    "free_batch"};
+
+/* Requests this many times slower than the p999 of their type are flagged */
+#define LAT_OUTLIER 10
+
+/*
+ * lat_percentile - the latency, in ticks, that a fraction q of the
+ *    requests in hist took at most, to within a bucket
+ */
+static unsigned long long lat_percentile(const lat_hist_t *hist, double q)
+{
+    unsigned long long rank = (unsigned long long)ceil(q * hist->count);
+    unsigned long long seen = 0;
+    int b;
+
+    for (b = 0; b < LAT_BUCKETS; b++)
+    {
+        seen += hist->bucket[b];
+        if (seen >= rank && seen > 0)
             break;
+    }
+    unsigned long long top = lat_bucket_top(b);
+    return top < hist->max ? top : hist->max;
+}
 
-        case FREE: /* mm_free */
-            index = trace->ops[i].index;
-            if (index < 0)
-            {
-                block = 0;
-            }
-            else
+/*
+ * lat_total - sum the histograms of all request types in lat into total
+ */
+static void lat_total(const latency_t *lat, lat_hist_t *total)
+{
+    int type, b;
+
+    memset(total, 0, sizeof(*total));
+    for (type = 0; type <= FREE_BATCH; type++)
+    {
+        total->count += lat->hist[type].count;
+        if (lat->hist[type].max > total->max)
+            total->max = lat->hist[type].max;
+        for (b = 0; b < LAT_BUCKETS; b++)
+            total->bucket[b] += lat->hist[type].bucket[b];
+    }
+}
+
+/*
+ * print_latency - print the p50, p99, p999 and maximum latency of each
+ *    request type in lat, and the slowest requests that stand out
+ */
+static void print_latency(const char *filename, const latency_t *lat)
+{
+    double ns_per_tick = 1e9 / ticks_per_sec();
+    int type, i;
+
+    printf("Latency (ns) of %s:\n", filename);
+    printf("  %-12s %9s %9s %9s %9s %9s\n", "request", "count", "p50", "p99",
+           "p999", "max");
+    for (type = 0; type <= FREE_BATCH; type++)
+    {
+        const lat_hist_t *hist = &lat->hist[type];
+        if (hist->count == 0)
+            continue;
+        printf("  %-12s %9llu %9.0f %9.0f %9.0f %9.0f\n", op_names[type],
+               hist->count, lat_percentile(hist, 0.5) * ns_per_tick,
+               lat_percentile(hist, 0.99) * ns_per_tick,
+               lat_percentile(hist, 0.999) * ns_per_tick,
+               hist->max * ns_per_tick);
+    }
+
+    for (i = 0; i < LAT_SLOWEST && lat->slowest[i].ticks > 0; i++)
+    {
+        const traceop_t *op = &lat->slowest[i].op;
+        double p999 = (double)lat_percentile(&lat->hist[op->type], 0.999);
+        if (lat->slowest[i].ticks <= LAT_OUTLIER * p999)
+            continue;
+        printf("  outlier: %s of id %d", op_names[op->type], op->index);
+        if (op->type != FREE && op->type != FREE_BATCH)
+            printf(" (%zu bytes)", op->size);
+        printf(" took %.0f ns, %.0fx the p999\n",
+               lat->slowest[i].ticks * ns_per_tick,
+               lat->slowest[i].ticks / (p999 > 0 ? p999 : 1));
+    }
+}
+
+/*
+ * eval_mm_latency - replay the trace once more, timing each request on
+ *    its own, and print its latency percentiles.  A multithreaded driver
+ *    times each thread separately and adds them up.
+ */
+static void eval_mm_latency(speed_t *speed_params)
+{
+    trace_t *trace = speed_params->trace;
+    latency_t *lat;
+
+    if ((lat = calloc(1, sizeof(*lat))) == NULL)
+        unix_error("calloc failed in eval_mm_latency");
+
+#if MT_MODE
+    if (mt_threads > 0)
+    {
+        mt_part_t *parts = split_trace(trace, mt_threads);
+        latency_t *part_lats;
+        lat_hist_t total;
+        double ns_per_tick = 1e9 / ticks_per_sec();
+        int t;
+
+        if ((part_lats = calloc(mt_threads, sizeof(*part_lats))) == NULL)
+            unix_error("calloc failed in eval_mm_latency");
+        for (t = 0; t < mt_threads; t++)
+            parts[t].lat = &part_lats[t];
+        speed_params->parts = parts;
+        eval_mm_mt_speed(speed_params);
+        speed_params->parts = NULL;
+
+        for (t = 0; t < mt_threads; t++)
+        {
+            merge_latency(lat, &part_lats[t]);
+            if (verbose > 1)
             {
-                block = trace->blocks[index];
+                lat_total(&part_lats[t], &total);
+                printf("  thread %d latency (ns): p50 %.0f p99 %.0f p999 "
+                       "%.0f max %.0f\n",
+                       t, lat_percentile(&total, 0.5) * ns_per_tick,
+                       lat_percentile(&total, 0.99) * ns_per_tick,
+                       lat_percentile(&total, 0.999) * ns_per_tick,
+                       total.max * ns_per_tick);
             }
-            mm_free(block);
-            break;
-
-        default:
-            app_error("Nonexistent request type in eval_mm_speed");
         }
+        free(part_lats);
+        free_parts(parts, mt_threads);
+    }
+    else
+#endif
+    {
+        speed_params->lat = lat;
+        eval_mm_speed(speed_params);
+        speed_params->lat = NULL;
+    }
+
+    print_latency(trace->filename, lat);
+    free(lat);
 }
+#endif /* !REF_ONLY */
 
 /*
  * eval_libc_valid - We run this function to make sure that the
@@ -1476,7 +2918,7 @@ static void eval_mm_speed(void *ptr)
  */
 static bool eval_libc_valid(trace_t *trace)
 {
-    int i;
+    int i, j;
     size_t newsize;
     char *p, *newp, *oldp;
 
@@ -1496,6 +2938,16 @@ static bool eval_libc_valid(trace_t *trace)
             trace->blocks[trace->ops[i].index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            if ((p = aligned_alloc(trace->ops[i].align,
+                                   trace->ops[i].size)) == NULL)
+            {
+                malloc_error(trace, i, "libc aligned_alloc failed");
+                unix_error("System message");
+            }
+            trace->blocks[trace->ops[i].index] = p;
+            break;
+
         case REALLOC: /* realloc */
             newsize = trace->ops[i].size;
             oldp = trace->blocks[trace->ops[i].index];
@@ -1518,6 +2970,29 @@ static bool eval_libc_valid(trace_t *trace)
             }
             break;
 
+        case FREE_SIZED: /* free */
+            free(trace->blocks[trace->ops[i].index]);
+            break;
+
+        case ALLOC_BATCH: /* malloc, once per block */
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                if ((p = malloc(trace->ops[i].size)) == NULL)
+                {
+                    malloc_error(trace, i, "libc malloc failed");
+                    unix_error("System message");
+                }
+                trace->blocks[trace->ops[i].index + j] = p;
+            }
+            break;
+
+        case FREE_BATCH: /* free, once per block */
+            for (j = 0; j < trace->ops[i].count; j++)
+            {
+                free(trace->blocks[trace->ops[i].index + j]);
+            }
+            break;
+
         default:
             app_error("invalid operation type  in eval_libc_valid");
         }
@@ -1533,7 +3008,7 @@ static bool eval_libc_valid(trace_t *trace)
  */
 static void eval_libc_speed(void *ptr)
 {
-    int i;
+    int i, j;
     int index;
     size_t size, newsize;
     char *p, *newp, *oldp, *block;
@@ -1553,6 +3028,14 @@ static void eval_libc_speed(void *ptr)
             trace->blocks[index] = p;
             break;
 
+        case MEMALIGN: /* aligned_alloc */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            if ((p = aligned_alloc(trace->ops[i].align, size)) == NULL)
+                unix_error("aligned_alloc failed in eval_libc_speed");
+            trace->blocks[index] = p;
+            break;
+
         case REALLOC: /* realloc */
             index = trace->ops[i].index;
             newsize = trace->ops[i].size;
@@ -1575,6 +3058,28 @@ static void eval_libc_speed(void *ptr)
                 free(0);
             }
             break;
+
+        case FREE_SIZED: /* free */
+            free(trace->blocks[trace->ops[i].index]);
+            break;
+
+        case ALLOC_BATCH: /* malloc, once per block */
+            index = trace->ops[i].index;
+            size = trace->ops[i].size;
+            for (j = index; j < index + trace->ops[i].count; j++)
+            {
+                if ((trace->blocks[j] = malloc(size)) == NULL)
+                    unix_error("malloc failed in eval_libc_speed");
+            }
+            break;
+
+        case FREE_BATCH: /* free, once per block */
+            index = trace->ops[i].index;
+            for (j = index; j < index + trace->ops[i].count; j++)
+            {
+                free(trace->blocks[j]);
+            }
+            break;
         }
     }
 }
@@ -2013,7 +3518,7 @@ static double measure_ref_throughput(bool checkpoint)
  */
 static void usage(char *prog)
 {
-    fprintf(stderr, "Usage: %s [-hlVCdD] [-f <file>]\n", prog);
+    fprintf(stderr, "Usage: %s [-hlVBCdD] [-f <file>]\n", prog);
     fprintf(stderr, "Options\n");
     fprintf(stderr, "\t-C         Calculate Checkpoint Score.\n");
     fprintf(stderr, "\t-d <i>     Debug: 0 off; 1 default; 2 lots.\n");
@@ -2027,5 +3532,17 @@ static void usage(char *prog)
     fprintf(stderr, "\t-v <i>     Set Verbosity Level to <i>\n");
     fprintf(stderr, "\t-s <s>     Timeout after s secs (default no timeout)\n");
     fprintf(stderr, "\t-T         Print diagnostics in tab mode\n");
+    fprintf(stderr, "\t-S         Print allocator statistics after each "
+                    "trace.\n");
     fprintf(stderr, "\t-f <file>  Use <file> as the trace file\n");
+    fprintf(stderr, "\t-B         Write each trace as a binary .rtb file "
+                    "next to it, and exit.\n");
+    fprintf(stderr, "\t-P <n>     Time each trace on <n> threads, which "
+                    "split its ids (mdriver-mt).\n");
+    fprintf(stderr, "\t-R         With -P, each thread replays its own copy "
+                    "of the trace.\n");
+    fprintf(stderr, "\t-L         Time each request, and print latency "
+                    "percentiles per trace.\n");
+    fprintf(stderr, "\t-j <n>     Check validity and utilization in <n> "
+                    "processes at once.\n");
 }
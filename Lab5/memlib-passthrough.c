@@ -5,8 +5,10 @@
  * This file allows compiling student malloc implementations so that they can
  * be used as an interpositioning library, and thereby run actual programs.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <assert.h>
 #include <stdint.h>
+#include <sys/mman.h>
 #include <unistd.h>
 
 #include "config.h"
@@ -16,10 +18,11 @@
 static bool init = false;
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
+static unsigned char *mem_fresh;    /* Highest break so far */
 
 static void ensure_init(void) {
     if (!init) {
-        mem_brk = heap = sbrk(0);
+        mem_brk = mem_fresh = heap = sbrk(0);
         assert(mem_brk != (void *)-1);
         init = true;
     }
@@ -35,9 +38,17 @@ void *mem_sbrk(intptr_t incr) {
 
     assert(res == mem_brk);
     mem_brk += incr;
+    if (mem_brk > mem_fresh) {
+        mem_fresh = mem_brk;
+    }
     return (void *) res;
 }
 
+void *mem_fresh_lo(void) {
+    ensure_init();
+    return (void *)mem_fresh;
+}
+
 void *mem_heap_lo(void) {
     ensure_init();
     return (void *)heap;
@@ -53,6 +64,19 @@ size_t mem_heapsize(void) {
     return (size_t)(mem_brk - heap);
 }
 
+void *mem_map(size_t size) {
+    return mmap(NULL, size, PROT_READ | PROT_WRITE,
+                MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+}
+
+int mem_unmap(void *addr, size_t size) {
+    return munmap(addr, size);
+}
+
+void *mem_remap(void *addr, size_t old_size, size_t new_size) {
+    return mremap(addr, old_size, new_size, MREMAP_MAYMOVE);
+}
+
 size_t mem_pagesize(void) {
     return (size_t)getpagesize();
 }
@@ -32,9 +32,9 @@
  *  sparse emulation has tighter checks.  Commonly, the CPU reports a
  *  BUS ERROR on these accesses, and should be debugged as segmentation faults.
  */
+#define _GNU_SOURCE /* for mremap */
 #include <assert.h>
 #include <errno.h>
-#include <fcntl.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
@@ -42,6 +42,10 @@
 #include <sys/mman.h>
 #include <unistd.h>
 
+#ifdef MEM_THREADS
+#include <pthread.h>
+#endif
+
 #ifdef USE_ASAN
 #include <sanitizer/asan_interface.h>
 #endif
@@ -53,21 +57,33 @@ void markGlobalsUninit(void);
 
 #include "config.h"
 #include "memlib.h"
+#include "stree.h"
 
 /* Data structure used to implement pages in sparse memory emulation */
 typedef struct MBLK
 {
     size_t id;         /* Page ID.  Counts number of pages from start of heap */
     struct MBLK *next; /* Link for hash table */
-    unsigned char initSet[SPARSE_PAGE_SIZE / 8];
+    uint64_t initSet[SPARSE_PAGE_SIZE / 64]; /* Bytes written so far */
     unsigned char bytes[SPARSE_PAGE_SIZE]; /* Page contents */
 } mem_block_t;
 
+/* A region handed out by mem_map */
+typedef struct MREG
+{
+    unsigned char *lo;  /* Starting address */
+    size_t size;        /* Length in bytes, a multiple of the page size */
+    struct MREG *prev;  /* Next higher region */
+    struct MREG *next;  /* Next lower region */
+} mem_region_t;
+
 /* private global variables */
 static bool sparse = false;         /* Use sparse memory emulation */
 static unsigned char *heap;         /* Starting address of heap */
 static unsigned char *mem_brk;      /* Current position of break */
 static unsigned char *mem_max_addr; /* Maximum allowable heap address */
+static size_t mem_peak_size = 0;    /* Peak heap + mapped bytes since reset */
+static unsigned char *mem_fresh;    /* Highest break since mem_init */
 static size_t mmap_length =
     MAX_DENSE_HEAP; /* Number of bytes allocated by mmap */
 static bool show_stats =
@@ -79,8 +95,32 @@ static bool stats_printed =
 static mem_block_t *next_free_page = NULL; /* Next free page */
 static size_t num_pages = 0;               /* Total number of pages */
 static size_t num_free_pages = 0;          /* Number of free pages */
-static mem_block_t **page_table = NULL;    /* Hash table from page ID to page */
-static size_t num_buckets = 0;             /* Number of buckets in page table */
+static mem_block_t **page_table = NULL;    /* Slots from page ID to page */
+static size_t num_direct = 0;              /* Directly indexed IDs at each end */
+static size_t num_buckets = 0;             /* Number of hash buckets */
+static size_t num_slots = 0;               /* Total number of slots */
+static mem_block_t *free_page_list = NULL; /* Pages dropped by mem_remap */
+static mem_block_t *last_page = NULL;      /* Page of the latest access */
+
+/*
+ * The page table starts with two directly indexed windows of num_direct
+ *  slots each, one counting up from the start of the heap and one counting
+ *  down from the top of the address space where mapped regions go.  Pages
+ *  in between, which only very large blocks reach, are hashed into the
+ *  buckets that follow.  A direct slot holds at most one page.
+ */
+#define LAST_PAGE_ID (MAX_SPARSE_HEAP / SPARSE_PAGE_SIZE - 1)
+
+/*
+ * Mapped regions are carved out of the top of the heap's address range,
+ *  growing down toward the break, and are kept in a list sorted by
+ *  descending address as well as in a tree keyed by starting address.
+ */
+static mem_region_t *regions = NULL; /* Highest mapped region */
+static tree_t *region_tree = NULL;   /* Mapped regions by starting address */
+static node_pool_t *region_nodes = NULL; /* Nodes of region_tree */
+static unsigned char *mem_map_lo;    /* Start of the lowest mapped region */
+static size_t mem_mapped = 0;        /* Number of bytes in mapped regions */
 
 #ifdef NO_CHECK_UB
 static const bool checkUB = false;
@@ -112,8 +152,27 @@ const char *__msan_default_options()
  */
 static size_t page_id(const void *addr);
 static void *page_start(size_t id);
+static mem_block_t **page_slot(size_t id);
 static void *get_mem(const void *addr, size_t, bool);
 static void print_stats();
+static bool is_emulated(const void *addr, size_t len);
+static void update_peak(void);
+static void clear_stale(unsigned char *lo, size_t size);
+static void release_pages(unsigned char *lo, size_t size);
+static void move_mapping(unsigned char *lo, size_t size, unsigned char *new_lo);
+static mem_block_t *unlink_pages(size_t id_lo, size_t id_hi);
+static void move_pages(unsigned char *lo, size_t size, unsigned char *new_lo,
+                       size_t new_size);
+static unsigned char *region_place(size_t size, mem_region_t **above);
+static void region_link(mem_region_t *r, mem_region_t *above);
+static void region_unlink(mem_region_t *r);
+static mem_region_t *region_find(const void *addr);
+static void region_clear(void);
+#ifdef USE_ASAN
+static void region_check(void);
+#endif
+static void mem_lock(void);
+static void mem_unlock(void);
 
 /*
  * mem_init - initialize the memory system model
@@ -126,12 +185,15 @@ void mem_init(bool do_sparse)
         /* Want sparse total allocation to approximately match the dense heap
          * size */
         /* Account for both page itself and its amortized contribution to the
-         * page table */
-        double fbytes_per_page =
-            sizeof(mem_block_t) + sizeof(mem_block_t *) / HASH_LOAD;
+         * page table: a slot in each direct window plus its share of the
+         * hash buckets */
+        double fbytes_per_page = sizeof(mem_block_t) +
+                                 sizeof(mem_block_t *) * (2 + 1 / HASH_LOAD);
         num_pages = (size_t)(MAX_DENSE_HEAP / fbytes_per_page);
+        num_direct = num_pages;
         num_buckets = num_pages / HASH_LOAD;
-        mmap_length = num_buckets * sizeof(mem_block_t *) + // Page table
+        num_slots = 2 * num_direct + num_buckets;
+        mmap_length = num_slots * sizeof(mem_block_t *) +   // Page table
                       num_pages * sizeof(mem_block_t) +     // Pages
                       sizeof(uint64_t);                     // Padding
         setUBCheck(true);
@@ -142,18 +204,23 @@ void mem_init(bool do_sparse)
         next_free_page = NULL;
         num_pages = 0;
         page_table = NULL;
+        num_direct = 0;
         num_buckets = 0;
+        num_slots = 0;
         mmap_length = MAX_DENSE_HEAP;
     }
 
-    int dev_zero = open("/dev/zero", O_RDWR);
+    /*
+     * Anonymous memory rather than a mapping of /dev/zero, so that mem_remap
+     *  can move pages across the pieces its earlier moves split it into
+     */
     void *start = sparse ? NULL : TRY_DENSE_HEAP_START;
-    void *addr = mmap(start,                  /* suggested start*/
-                      mmap_length,            /* length */
-                      PROT_READ | PROT_WRITE, /* permissions */
-                      MAP_PRIVATE,            /* private or shared? */
-                      dev_zero,               /* fd */
-                      0);                     /* offset */
+    void *addr = mmap(start,                        /* suggested start*/
+                      mmap_length,                  /* length */
+                      PROT_READ | PROT_WRITE,       /* permissions */
+                      MAP_PRIVATE | MAP_ANONYMOUS,  /* private or shared? */
+                      -1,                           /* fd */
+                      0);                           /* offset */
     if (addr == MAP_FAILED)
     {
         fprintf(stderr, "FAILURE.  mmap couldn't allocate space for heap\n");
@@ -173,6 +240,15 @@ void mem_init(bool do_sparse)
     }
     stats_printed = false;
     mem_brk = heap;
+    mem_fresh = heap;
+    mem_peak_size = 0;
+    free_page_list = NULL;
+    last_page = NULL;
+    regions = NULL;
+    region_nodes = pool_new();
+    region_tree = tree_new_pool(region_nodes);
+    mem_map_lo = mem_max_addr;
+    mem_mapped = 0;
 }
 
 /*
@@ -181,11 +257,19 @@ void mem_init(bool do_sparse)
 void mem_deinit(void)
 {
     print_stats();
+    region_clear();
+    tree_free(region_tree, NULL);
+    region_tree = NULL;
+    pool_free(region_nodes);
+    region_nodes = NULL;
     munmap(heap, mmap_length);
     next_free_page = NULL;
     num_free_pages = 0;
     page_table = NULL;
+    num_direct = 0;
     num_buckets = 0;
+    num_slots = 0;
+    last_page = NULL;
 }
 
 /*
@@ -197,11 +281,13 @@ void mem_reset_brk()
     if (sparse)
     {
         /* Clear page table */
-        size_t ptb = num_buckets * sizeof(mem_block_t *);
+        size_t ptb = num_slots * sizeof(mem_block_t *);
         memset((void *)page_table, 0, ptb);
         /* First page is just beyond page table */
         next_free_page = (mem_block_t *)((unsigned char *)page_table + ptb);
         num_free_pages = num_pages;
+        free_page_list = NULL;
+        last_page = NULL;
     }
     else
     {
@@ -217,28 +303,31 @@ void mem_reset_brk()
         __msan_allocated_memory(heap, MAX_DENSE_HEAP);
 #endif
     }
+    region_clear();
     mem_brk = heap;
+    mem_peak_size = 0;
 }
 
 /*
- * mem_sbrk - simple model of the sbrk function. Extends the heap
- *                by incr bytes and returns the start address of the new area.
- * In this model, the heap cannot be shrunk.
+ * heap_sbrk - simple model of the sbrk function. Extends the heap
+ *             by incr bytes and returns the start address of the new area.
+ * A negative incr shrinks the heap, giving the released pages back to the
+ * system in dense mode.
  */
-void *mem_sbrk(intptr_t incr)
+static void *heap_sbrk(intptr_t incr)
 {
     unsigned char *old_brk = mem_brk;
 
     bool ok = true;
-    if (incr < 0)
+    if (incr < 0 && (size_t)-incr > (size_t)(mem_brk - heap))
     {
         ok = false;
         fprintf(stderr,
-                "ERROR: mem_sbrk failed.  Attempt to expand heap by negative "
-                "value %ld\n",
-                (long)incr);
+                "ERROR: mem_sbrk failed.  Attempt to shrink heap by %ld "
+                "bytes, below its start\n",
+                (long)-incr);
     }
-    else if (mem_brk + incr > mem_max_addr)
+    else if (incr > 0 && incr > mem_map_lo - mem_brk)
     {
         ok = false;
         size_t alloc = mem_brk - heap + incr;
@@ -247,7 +336,7 @@ void *mem_sbrk(intptr_t incr)
                 "heap size of %zd (0x%zx) bytes\n",
                 alloc, alloc);
     }
-    else if (!sparse && sbrk(incr) == (void *)-1)
+    else if (!sparse && incr > 0 && sbrk(incr) == (void *)-1)
     {
         ok = false;
         fprintf(
@@ -255,20 +344,63 @@ void *mem_sbrk(intptr_t incr)
             "ERROR: mem_sbrk failed.  Could not allocate more heap space\n");
     }
 
-    if (ok)
+    if (!ok)
+    {
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+
+    if (incr >= 0)
     {
 #ifdef USE_ASAN
         /* Mark the extended section of the heap as addressable */
         __asan_unpoison_memory_region(mem_brk, incr);
 #endif
         mem_brk += incr;
+        if (mem_brk > mem_fresh)
+        {
+#ifdef USE_MSAN
+            /* Never-used bytes are zero, and so initialized */
+            unsigned char *lo = old_brk > mem_fresh ? old_brk : mem_fresh;
+            __msan_unpoison(lo, mem_brk - lo);
+#endif
+            mem_fresh = mem_brk;
+        }
+        update_peak();
         return (void *)old_brk;
     }
-    else
+
+    /* The real break is left alone: libc's heap may have grown above it */
+    mem_brk += incr;
+    if (!sparse)
     {
-        errno = ENOMEM;
-        return (void *)-1;
+        /* Drop the whole pages above the new break, so that they read as
+         * zero and stop counting toward the resident set */
+        size_t pagesize = mem_pagesize();
+        uintptr_t first = ((uintptr_t)mem_brk + pagesize - 1) & ~(pagesize - 1);
+        if (first < (uintptr_t)old_brk)
+            madvise((void *)first, (uintptr_t)old_brk - first, MADV_DONTNEED);
     }
+#ifdef USE_ASAN
+    /* Mark the released section of the heap as unaddressable */
+    __asan_poison_memory_region(mem_brk, -incr);
+#endif
+#ifdef USE_MSAN
+    /* Bytes released and then reclaimed are uninitialized */
+    __msan_allocated_memory(mem_brk, -incr);
+#endif
+    return (void *)old_brk;
+}
+
+/*
+ * mem_sbrk - heap_sbrk under the memory system lock
+ */
+void *mem_sbrk(intptr_t incr)
+{
+    mem_lock();
+    void *old_brk = heap_sbrk(incr);
+    mem_unlock();
+    return old_brk;
 }
 
 /*
@@ -295,6 +427,200 @@ size_t mem_heapsize()
     return (size_t)(mem_brk - heap);
 }
 
+/*
+ * mem_peak_heapsize() - returns the largest footprint, in bytes, of the heap
+ *                       and mapped regions together since the last reset
+ */
+size_t mem_peak_heapsize()
+{
+    return mem_peak_size;
+}
+
+/*
+ * mem_fresh_lo - return the highest break since mem_init, above which the
+ *                heap's memory has never been used and reads as zero.  Sparse
+ *                mode reuses its emulated pages without clearing them.
+ */
+void *mem_fresh_lo()
+{
+    return sparse ? NULL : (void *)mem_fresh;
+}
+
+/*
+ * region_map - simple model of an anonymous mmap.  Sets aside a region of
+ *              at least size bytes, rounded up to whole pages, above the
+ *              break.
+ */
+static void *region_map(size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    mem_region_t *above;
+    unsigned char *lo = size == 0 ? NULL : region_place(size, &above);
+    if (lo == NULL)
+    {
+        fprintf(stderr,
+                "ERROR: mem_map failed.  Ran out of memory.  Would require "
+                "%zd (0x%zx) more bytes\n",
+                size, size);
+        errno = ENOMEM;
+        return (void *)-1;
+    }
+
+    mem_region_t *r = (mem_region_t *)malloc(sizeof(mem_region_t));
+    if (r == NULL)
+    {
+        fprintf(stderr, "FAILURE.  malloc failed in mem_map\n");
+        exit(1);
+    }
+    r->lo = lo;
+    r->size = size;
+    region_link(r, above);
+    mem_mapped += size;
+    update_peak();
+    clear_stale(lo, size);
+#ifdef USE_ASAN
+    __asan_unpoison_memory_region(lo, size);
+#endif
+#ifdef USE_MSAN
+    __msan_unpoison(lo, size);
+#endif
+    return (void *)lo;
+}
+
+/*
+ * mem_map - region_map under the memory system lock
+ */
+void *mem_map(size_t size)
+{
+    mem_lock();
+    void *lo = region_map(size);
+    mem_unlock();
+    return lo;
+}
+
+/*
+ * region_unmap - releases a whole region returned by mem_map or mem_remap
+ */
+static int region_unmap(void *addr, size_t size)
+{
+    size_t pagesize = mem_pagesize();
+    size = (size + pagesize - 1) & ~(pagesize - 1);
+
+    mem_region_t *r = region_find(addr);
+    if (r == NULL || r->lo != addr || r->size != size)
+    {
+        fprintf(stderr,
+                "ERROR: mem_unmap failed.  %p:%zd is not a mapped region\n",
+                addr, size);
+        errno = EINVAL;
+        return -1;
+    }
+
+    region_unlink(r);
+    release_pages(r->lo, r->size);
+    mem_mapped -= r->size;
+    free(r);
+    return 0;
+}
+
+/*
+ * mem_unmap - region_unmap under the memory system lock
+ */
+int mem_unmap(void *addr, size_t size)
+{
+    mem_lock();
+    int res = region_unmap(addr, size);
+    mem_unlock();
+    return res;
+}
+
+/*
+ * region_remap - resizes a mapped region.  The region grows in place when
+ *                the space above it is free; otherwise its pages are moved
+ *                to a new address rather than copied.
+ */
+static void *region_remap(void *addr, size_t old_size, size_t new_size)
+{
+    size_t pagesize = mem_pagesize();
+    old_size = (old_size + pagesize - 1) & ~(pagesize - 1);
+    new_size = (new_size + pagesize - 1) & ~(pagesize - 1);
+
+    mem_region_t *r = region_find(addr);
+    if (r == NULL || r->lo != addr || r->size != old_size || new_size == 0)
+    {
+        fprintf(stderr,
+                "ERROR: mem_remap failed.  %p:%zd is not a mapped region\n",
+                addr, old_size);
+        errno = EINVAL;
+        return (void *)-1;
+    }
+
+    unsigned char *top = r->prev ? r->prev->lo : mem_max_addr;
+    if (new_size <= old_size)
+    {
+        release_pages(r->lo + new_size, old_size - new_size);
+    }
+    else if ((size_t)(top - r->lo) < new_size)
+    {
+        mem_region_t *above;
+        unsigned char *lo = region_place(new_size, &above);
+        if (lo == NULL)
+        {
+            fprintf(stderr,
+                    "ERROR: mem_remap failed.  Ran out of memory.  Would "
+                    "require %zd (0x%zx) more bytes\n",
+                    new_size, new_size);
+            errno = ENOMEM;
+            return (void *)-1;
+        }
+        move_pages(r->lo, old_size, lo, new_size);
+        clear_stale(lo + old_size, new_size - old_size);
+        if (above == r)
+            above = r->prev;
+        region_unlink(r);
+        r->lo = lo;
+        region_link(r, above);
+    }
+    else
+    {
+        clear_stale(r->lo + old_size, new_size - old_size);
+#ifdef USE_ASAN
+        __asan_unpoison_memory_region(r->lo + old_size, new_size - old_size);
+#endif
+    }
+
+    r->size = new_size;
+    mem_mapped = mem_mapped - old_size + new_size;
+    update_peak();
+    return (void *)r->lo;
+}
+
+/*
+ * mem_remap - region_remap under the memory system lock
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size)
+{
+    mem_lock();
+    void *lo = region_remap(addr, old_size, new_size);
+    mem_unlock();
+    return lo;
+}
+
+/*
+ * mem_is_mapped - returns whether the bytes lo...hi all lie within one
+ *                 mapped region
+ */
+bool mem_is_mapped(const void *lo, const void *hi)
+{
+    mem_lock();
+    mem_region_t *r = region_find(lo);
+    bool mapped = r != NULL && (unsigned char *)hi < r->lo + r->size;
+    mem_unlock();
+    return mapped;
+}
+
 /*
  * mem_pagesize() - returns the page size of the system
  */
@@ -303,6 +629,34 @@ size_t mem_pagesize()
     return (size_t)getpagesize();
 }
 
+/*
+ * mem_lock, mem_unlock - serialize the calls that move the break or change
+ *                        the mapped regions, when built with MEM_THREADS
+ *                        for allocators that call them from several
+ *                        threads at once
+ */
+#ifdef MEM_THREADS
+static pthread_mutex_t mem_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+static void mem_lock(void)
+{
+    pthread_mutex_lock(&mem_mutex);
+}
+
+static void mem_unlock(void)
+{
+    pthread_mutex_unlock(&mem_mutex);
+}
+#else
+static void mem_lock(void)
+{
+}
+
+static void mem_unlock(void)
+{
+}
+#endif
+
 /*************** Memory emulation  *******************/
 
 __int128 mem_read128(const void *addr)
@@ -323,8 +677,7 @@ void mem_write128(void *addr, __int128 val)
 uint64_t mem_read(const void *addr, size_t len)
 {
     uint64_t rdata;
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (is_emulated(addr, len))
     {
         /* Heap read.  Check if it crosses page boundary */
         size_t id = page_id(addr);
@@ -367,8 +720,7 @@ uint64_t mem_read(const void *addr, size_t len)
 /* Write lower order len bytes of val to address */
 void mem_write(void *addr, uint64_t val, size_t len)
 {
-    if (sparse && (unsigned char *)addr >= heap &&
-        (unsigned char *)addr + len <= mem_brk)
+    if (is_emulated(addr, len))
     {
         /* Heap write.  Check to see if it crosses page boundary */
         size_t id = page_id(addr);
@@ -523,37 +875,58 @@ static void *page_start(size_t id)
     return (void *)((unsigned char *)SPARSE_HEAP_START + offset);
 }
 
+/* Find the page table slot that heads the chain for a page ID */
+static mem_block_t **page_slot(size_t id)
+{
+    if (id < num_direct)
+        return &page_table[id];
+    if (LAST_PAGE_ID - id < num_direct)
+        return &page_table[num_direct + (LAST_PAGE_ID - id)];
+    return &page_table[2 * num_direct + id % num_buckets];
+}
+
 /* Get memory to store value.  Allocate page if necessary */
 static void *get_mem(const void *addr, size_t size, bool isWrite)
 {
     size_t id = page_id(addr);
-    size_t b = id % num_buckets; // A very simple hash function
-    unsigned int i;
+    mem_block_t *block = last_page;
 
-    mem_block_t *block = page_table[b];
-    while (block && block->id != id)
-        block = block->next;
-    if (!block)
+    /* Consecutive accesses mostly fall within one page */
+    if (!block || block->id != id)
     {
-        /* Need to allocate a new block */
-        if (num_free_pages == 0)
+        mem_block_t **slot = page_slot(id);
+        block = *slot;
+        while (block && block->id != id)
+            block = block->next;
+        if (!block)
         {
-            /*
-             * This will often fail due to student code that either accesses
-             *  too many memory locations, such as checking every byte in a
-             *  block.  Or more commonly due to poor utilization, such as
-             *  leaking or not finding the huge allocations.
-             */
-            fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
-            exit(1);
+            /* Need to allocate a new block */
+            if (num_free_pages == 0)
+            {
+                /*
+                 * This will often fail due to student code that either
+                 *  accesses too many memory locations, such as checking
+                 *  every byte in a block.  Or more commonly due to poor
+                 *  utilization, such as leaking or not finding the huge
+                 *  allocations.
+                 */
+                fprintf(stderr, "FAILURE.  Ran out of memory for emulation\n");
+                exit(1);
+            }
+            if (free_page_list)
+            {
+                block = free_page_list;
+                free_page_list = block->next;
+            }
+            else
+                block = next_free_page++;
+            num_free_pages--;
+            block->id = id;
+            block->next = *slot;
+            memset(block->initSet, 0, sizeof(block->initSet));
+            *slot = block;
         }
-        block = next_free_page++;
-        num_free_pages--;
-        block->id = id;
-        block->next = page_table[b];
-        for (i = 0; i < (SPARSE_PAGE_SIZE / 8); i++)
-            block->initSet[i] = 0;
-        page_table[b] = block;
+        last_page = block;
     }
 
     // Convert an emulated address into an offset
@@ -561,41 +934,318 @@ static void *get_mem(const void *addr, size_t size, bool isWrite)
     size_t offset = (unsigned char *)addr - (unsigned char *)saddr;
 
 #ifndef NO_CHECK_UB
-    // Compute the bit vector lookup for this 'offset'
-    size_t offsetIdx = offset / 8;
-    size_t offsetBit = offset & 0x7;
-
-    // For each byte in this access, update the bitvector that tracks
-    //  the use / initialization of emulated bytes.
-    for (i = 0; i < size; i++)
+    // Update or check the bits that track the use / initialization of
+    //  emulated bytes a word at a time.  The bytes of an access span at
+    //  most two words, and any beyond the page are left to the next page.
+    size_t offsetIdx = offset / 64;
+    size_t offsetBit = offset % 64;
+    size_t done = 0;
+    while (done < size && offsetIdx < (SPARSE_PAGE_SIZE / 64))
     {
+        size_t nbits = 64 - offsetBit;
+        if (nbits > size - done)
+            nbits = size - done;
+        uint64_t mask = nbits == 64 ? ~(uint64_t)0
+                                    : (((uint64_t)1 << nbits) - 1) << offsetBit;
+        uint64_t *word = &block->initSet[offsetIdx];
         if (isWrite)
         {
-            block->initSet[offsetIdx] |= (0x1 << offsetBit);
+            *word |= mask;
         }
-        else if (checkUB &&
-                 (block->initSet[offsetIdx] & (0x1 << offsetBit)) == 0)
+        else if (checkUB && (*word & mask) != mask)
         {
             // The student code has attempted to read an address that was
             //  never written to.  Students should set a breakpoint on this
             //  line / check and then backtrace to where their code has
             //  made the memory access.
+            size_t i = done + __builtin_ctzll(~*word & mask) - offsetBit;
             fprintf(stderr,
                     "Attempt to read uninitialized address %p, see %s:%d for "
                     "details\n",
                     (addr + i), __FILE__, __LINE__);
             abort();
         }
-        offsetBit++;
-        if (offsetBit == 8)
+        done += nbits;
+        offsetBit = 0;
+        offsetIdx++;
+    }
+#endif
+
+    return (void *)&block->bytes[offset];
+}
+
+/* Is [addr, addr + len) emulated memory, in the heap or a mapped region? */
+static bool is_emulated(const void *addr, size_t len)
+{
+    const unsigned char *p = (const unsigned char *)addr;
+    return sparse && ((p >= heap && p + len <= mem_brk) ||
+                      (p >= mem_map_lo && p + len <= mem_max_addr));
+}
+
+/* Record a new high-water mark of the heap and mapped regions */
+static void update_peak(void)
+{
+    size_t size = (size_t)(mem_brk - heap) + mem_mapped;
+    if (size > mem_peak_size)
+        mem_peak_size = size;
+}
+
+/*
+ * Give the pages of a released range back to the system.  Sparse mode
+ *  keeps their emulated pages, which are reused if the range is mapped again.
+ */
+static void release_pages(unsigned char *lo, size_t size)
+{
+    if (!sparse && size > 0)
+        madvise(lo, size, MADV_DONTNEED);
+#ifdef USE_ASAN
+    __asan_poison_memory_region(lo, size);
+#endif
+}
+
+/*
+ * Clear the pages of a range being mapped that may still hold data, either
+ *  from the heap of an earlier run or from a region forgotten by a reset, so
+ *  that mapped memory reads as zero.
+ */
+static void clear_stale(unsigned char *lo, size_t size)
+{
+    if (!sparse && size > 0)
+        madvise(lo, size, MADV_DONTNEED);
+}
+
+/*
+ * Move size bytes of pages from lo to new_lo with mremap, and refill the
+ *  hole left behind so that the heap's mapping stays whole.  Earlier moves
+ *  split the heap into several kernel mappings, which a single mremap cannot
+ *  span, so the range is halved until each piece lies within one.
+ */
+static void move_mapping(unsigned char *lo, size_t size, unsigned char *new_lo)
+{
+    size_t pagesize = mem_pagesize();
+    if (mremap(lo, size, size, MREMAP_MAYMOVE | MREMAP_FIXED, new_lo) ==
+        MAP_FAILED)
+    {
+        /* A failed mremap may already have unmapped the destination */
+        if (errno != EFAULT || size <= pagesize ||
+            mmap(new_lo, size, PROT_READ | PROT_WRITE,
+                 MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1,
+                 0) == MAP_FAILED)
+        {
+            fprintf(stderr, "FAILURE.  mremap couldn't move mapped region\n");
+            exit(1);
+        }
+        size_t half = (size / 2) & ~(pagesize - 1);
+        move_mapping(lo, half, new_lo);
+        move_mapping(lo + half, size - half, new_lo + half);
+        return;
+    }
+    if (mmap(lo, size, PROT_READ | PROT_WRITE,
+             MAP_PRIVATE | MAP_ANONYMOUS | MAP_FIXED, -1, 0) == MAP_FAILED)
+    {
+        fprintf(stderr, "FAILURE.  mmap couldn't refill moved region\n");
+        exit(1);
+    }
+}
+
+/*
+ * Move the pages of a mapped range to a free range of new_size bytes,
+ *  without copying them.  Dense mode remaps the pages themselves, while
+ *  sparse mode renumbers the emulated pages and drops any stale pages left
+ *  at the destination.
+ */
+static void move_pages(unsigned char *lo, size_t size, unsigned char *new_lo,
+                       size_t new_size)
+{
+    if (!sparse)
+    {
+        move_mapping(lo, size, new_lo);
+#ifdef USE_ASAN
+        __asan_poison_memory_region(lo, size);
+        __asan_unpoison_memory_region(new_lo, new_size);
+#endif
+#ifdef USE_MSAN
+        __msan_copy_shadow(new_lo, lo, size);
+        __msan_unpoison(new_lo + size, new_size - size);
+#endif
+        return;
+    }
+
+    size_t id_lo = page_id(lo);
+    size_t id_hi = page_id(lo + size);
+    size_t new_id_lo = page_id(new_lo);
+    size_t new_id_hi = page_id(new_lo + new_size);
+    last_page = NULL;
+    mem_block_t *moved = unlink_pages(id_lo, id_hi);
+    mem_block_t *stale = unlink_pages(new_id_lo, new_id_hi);
+    while (stale)
+    {
+        mem_block_t *block = stale;
+        stale = block->next;
+        block->next = free_page_list;
+        free_page_list = block;
+        num_free_pages++;
+    }
+    while (moved)
+    {
+        mem_block_t *block = moved;
+        moved = block->next;
+        block->id = block->id - id_lo + new_id_lo;
+        mem_block_t **slot = page_slot(block->id);
+        block->next = *slot;
+        *slot = block;
+    }
+}
+
+/*
+ * Take the pages with IDs in [id_lo, id_hi) out of the page table and
+ *  return them as a list.  A short range looks up the slot of each ID,
+ *  while a long one scans the whole table.
+ */
+static mem_block_t *unlink_pages(size_t id_lo, size_t id_hi)
+{
+    mem_block_t *list = NULL;
+    bool by_id = id_hi - id_lo < num_slots;
+    size_t n = by_id ? id_hi - id_lo : num_slots;
+    size_t i;
+    for (i = 0; i < n; i++)
+    {
+        mem_block_t **link = by_id ? page_slot(id_lo + i) : &page_table[i];
+        while (*link)
+        {
+            mem_block_t *block = *link;
+            if (block->id >= id_lo && block->id < id_hi)
+            {
+                *link = block->next;
+                block->next = list;
+                list = block;
+            }
+            else
+                link = &block->next;
+        }
+    }
+    return list;
+}
+
+/*
+ * Find room for a mapped region of size bytes: the lowest part of the first
+ *  gap between regions that is large enough, or else just below the lowest
+ *  region.  Sets *above to the region the new one goes below.  Returns NULL
+ *  if the region would run into the break.
+ */
+static unsigned char *region_place(size_t size, mem_region_t **above)
+{
+    unsigned char *top = mem_max_addr;
+    mem_region_t *prev = NULL;
+    mem_region_t *r;
+    for (r = regions; r; r = r->next)
+    {
+        unsigned char *bottom = r->lo + r->size;
+        if ((size_t)(top - bottom) >= size)
         {
-            offsetBit = 0;
-            offsetIdx++;
+            *above = prev;
+            return bottom;
         }
-        if (offsetIdx == (SPARSE_PAGE_SIZE / 8))
-            break;
+        prev = r;
+        top = r->lo;
     }
+    *above = prev;
+    return (size_t)(top - mem_brk) >= size ? top - size : NULL;
+}
+
+/* Insert a region into the list just below above (at the head if NULL) */
+static void region_link(mem_region_t *r, mem_region_t *above)
+{
+    r->prev = above;
+    r->next = above ? above->next : regions;
+    if (above)
+        above->next = r;
+    else
+        regions = r;
+    if (r->next)
+        r->next->prev = r;
+    else
+        mem_map_lo = r->lo;
+    tree_insert(region_tree, (tkey_t)r->lo, (void *)r);
+}
+
+static void region_unlink(mem_region_t *r)
+{
+    if (r->prev)
+        r->prev->next = r->next;
+    else
+        regions = r->next;
+    if (r->next)
+        r->next->prev = r->prev;
+    else
+        mem_map_lo = r->prev ? r->prev->lo : mem_max_addr;
+    tree_remove(region_tree, (tkey_t)r->lo);
+}
+
+/* Find the mapped region containing an address, or NULL */
+static mem_region_t *region_find(const void *addr)
+{
+    mem_region_t *r =
+        (mem_region_t *)tree_find_nearest(region_tree, (tkey_t)addr);
+    if (r && (unsigned char *)addr < r->lo + r->size)
+        return r;
+    return NULL;
+}
+
+#ifdef USE_ASAN
+/*
+ * region_check - checks that the region list is sorted and that the
+ *                region tree holds exactly its regions, by building a
+ *                balanced tree from the list and comparing the two
+ */
+static void region_check(void)
+{
+    size_t n = 0;
+    mem_region_t *r;
+    for (r = regions; r; r = r->next)
+        n++;
+
+    tkey_t *keys = (tkey_t *)malloc((n + 1) * sizeof(tkey_t));
+    void **records = (void **)malloc((n + 1) * sizeof(void *));
+    if (keys == NULL || records == NULL)
+    {
+        fprintf(stderr, "FAILURE.  malloc failed in region_check\n");
+        exit(1);
+    }
+    /* The list runs from the highest region down */
+    size_t i = n;
+    for (r = regions; r; r = r->next)
+    {
+        i--;
+        keys[i] = (tkey_t)r->lo;
+        records[i] = (void *)r;
+    }
+
+    tree_t *sorted = tree_new_pool(region_nodes);
+    bool ok = tree_build(sorted, keys, records, n) &&
+              sorted->node_count == region_tree->node_count;
+    for (i = 0; ok && i < n; i++)
+        ok = tree_find(region_tree, keys[i]) == records[i];
+    if (!ok)
+    {
+        fprintf(stderr, "ERROR: mapped region list and tree disagree\n");
+        exit(1);
+    }
+    tree_free(sorted, NULL);
+    free(keys);
+    free(records);
+}
 #endif
 
-    return (void *)&block->bytes[offset];
+/* Forget every mapped region */
+static void region_clear(void)
+{
+#ifdef USE_ASAN
+    region_check();
+#endif
+    tree_free(region_tree, free);
+    region_tree = tree_new_pool(region_nodes);
+    regions = NULL;
+    mem_map_lo = mem_max_addr;
+    mem_mapped = 0;
 }
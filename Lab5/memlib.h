@@ -24,13 +24,14 @@ void mem_deinit(void);
 /**
  * @brief Extends the heap by incr bytes.
  *
- * This function is a simple model of the sbrk() function, except for that
- * with this implementation, the heap cannot be shrunk.
+ * This function is a simple model of the sbrk() function. A negative incr
+ * shrinks the heap by -incr bytes; the released bytes must no longer be
+ * accessed.
  *
  * @param[in] incr The amount of bytes by which to extend the heap
  * @return The start address of the new heap area (i.e. the previous
  *         breakpoint)
- * @pre `incr > 0`
+ * @pre `-incr <= mem_heapsize()`
  */
 void *mem_sbrk(intptr_t incr);
 
@@ -61,6 +62,72 @@ void *mem_heap_hi(void);
  */
 size_t mem_heapsize(void);
 
+/**
+ * @brief Returns the largest footprint since the heap was last reset.
+ *
+ * The footprint counts both the heap and the regions returned by mem_map.
+ *
+ * @return The peak size of the heap and mapped regions together, in bytes
+ */
+size_t mem_peak_heapsize(void);
+
+/**
+ * @brief Returns where memory that the heap has never held begins.
+ *
+ * The bytes that mem_sbrk hands out at or above this address have never
+ * been part of the heap before and read as zero, as do the regions returned
+ * by mem_map and the bytes that mem_remap adds to one. Memory that the heap
+ * gave back and then regrew into keeps its old contents.
+ *
+ * @return The heap's high-water mark, or NULL if new memory is not known to
+ *         be zero-filled
+ */
+void *mem_fresh_lo(void);
+
+/**
+ * @brief Maps a region of memory outside of the heap.
+ *
+ * This function is a simple model of an anonymous mmap(). The region does
+ * not move when the heap grows, and is returned to the system by mem_unmap.
+ * Its initial contents are zero if mem_fresh_lo is not NULL, and are
+ * otherwise unspecified.
+ *
+ * @param[in] size The number of bytes needed, rounded up to whole pages
+ * @return The page-aligned start of the region, or (void *)-1 on failure
+ */
+void *mem_map(size_t size);
+
+/**
+ * @brief Releases a region returned by mem_map or mem_remap.
+ * @param[in] addr The start of the region
+ * @param[in] size The size the region was mapped or last remapped with
+ * @return 0 on success, or -1 if addr and size do not name a whole region
+ */
+int mem_unmap(void *addr, size_t size);
+
+/**
+ * @brief Resizes a region returned by mem_map or mem_remap.
+ *
+ * This function is a simple model of mremap() with MREMAP_MAYMOVE. The
+ * region grows in place if it can, and is otherwise moved without copying
+ * its contents. The first min(old_size, new_size) bytes are preserved.
+ *
+ * @param[in] addr     The start of the region
+ * @param[in] old_size The size the region was mapped or last remapped with
+ * @param[in] new_size The number of bytes needed, rounded up to whole pages
+ * @return The new start of the region, or (void *)-1 on failure, in which
+ *         case the region is left unchanged
+ */
+void *mem_remap(void *addr, size_t old_size, size_t new_size);
+
+/**
+ * @brief Checks whether a range of bytes lies within a single mapped region.
+ * @param[in] lo The first byte of the range
+ * @param[in] hi The last byte of the range
+ * @return True if lo...hi lies within a region returned by mem_map
+ */
+bool mem_is_mapped(const void *lo, const void *hi);
+
 /**
  * @brief Returns the system page size.
  * @return The page size of the system, in bytes
@@ -20,6 +20,7 @@
  */
 
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
 #include <stdbool.h>
 #include <stddef.h>
@@ -45,6 +46,14 @@
 
 /* You can change anything from here onward */
 
+#ifdef DRIVER
+#define memalign mm_memalign
+#define aligned_alloc mm_aligned_alloc
+#define free_sized mm_free_sized
+#define malloc_batch mm_malloc_batch
+#define free_batch mm_free_batch
+#endif
+
 /*
  *****************************************************************************
  * If DEBUG is defined (such as when running mdriver-dbg), these macros      *
@@ -72,42 +81,111 @@
 #define dbg_printheap(...) ((void)sizeof(__VA_ARGS__))
 #endif
 
+/*
+ * If MM_THREAD_CACHE is set to 1 (e.g. -DMM_THREAD_CACHE=1), the allocator
+ * becomes thread-safe: the shared heap is protected by a single mutex, and
+ * each thread keeps a small cache of recently freed small blocks that it can
+ * reuse without taking the lock.
+ */
+#ifndef MM_THREAD_CACHE
+#define MM_THREAD_CACHE 0
+#endif
+
+#if MM_THREAD_CACHE
+#include <pthread.h>
+#endif
+
+/*
+ * MM_ARENAS sets how many independent heaps (arenas) a thread-safe build
+ * spreads its threads over; the default of 4 applies only with
+ * MM_THREAD_CACHE. Arena 0 is the memlib heap, and every other arena is a
+ * region of arena_size bytes from mem_map, mapped when a thread first uses
+ * it, with its own prologue, free lists, epilogue and lock. Threads are given
+ * arenas round-robin on their first allocation and keep them; a block always
+ * goes back to the arena it came from. An arena whose region is full spills
+ * its allocations into arena 0.
+ */
+#ifndef MM_ARENAS
+#define MM_ARENAS (MM_THREAD_CACHE ? 4 : 1)
+#endif
+
+#if MM_ARENAS > 1 && !MM_THREAD_CACHE
+#error "MM_ARENAS > 1 needs MM_THREAD_CACHE"
+#endif
+
 /* Basic constants */
 
 typedef uint64_t word_t;
 
-/** @brief Word and header size (bytes) */
+/**
+ * Block headers and footers are 4-byte tags. Every block starts 4 bytes below
+ * a 16-byte boundary, so its payload is aligned and a 16-byte block holds a
+ * 12-byte payload.
+ */
+typedef uint32_t tag_t;
+
+/** @brief Word size (bytes) */
 static const size_t wsize = sizeof(word_t);
 
 /** @brief Double word size (bytes) */
 static const size_t dsize = 2 * wsize;
 
+/** @brief Header and footer size (bytes) */
+static const size_t tsize = sizeof(tag_t);
+
 /** @brief Minimum block size of an alloc'd block (bytes) */
 static const size_t min_block_size = 1 * dsize;
 
+/**
+ * @brief Largest size (bytes) a tag can hold. Allocated heap blocks stay
+ * below it; a larger free block has tags of size 0 and keeps its size in the
+ * word after its tree links and in the word before its footer.
+ */
+static const size_t max_tag_size = ((size_t)1 << 32) - 16;
+
 /**
  * Ammount to extend the heap by minimally
  * (Must be divisible by dsize)
  */
 static const size_t chunksize = (1 << 12);
 
+/**
+ * A free block at the end of the heap of at least this many bytes is cut
+ * back to chunksize bytes, and the rest returned with a negative mem_sbrk
+ * (Must be larger than chunksize)
+ */
+static const size_t trim_threshold = (1 << 17);
+
+/**
+ * Requests of at least this many bytes get a region of their own from
+ * mem_map, which goes back to memlib as soon as they are freed
+ */
+static const size_t map_threshold = (1 << 20);
+
+/**
+ * malloc_batch carves runs of up to this many bytes out of a single fit,
+ * one block after the other
+ */
+static const size_t batch_max_size = (1 << 14);
+
 /**
  * get alloc bit from header / footer
  */
-static const word_t alloc_mask = 0x1;
-static const word_t prev_alloc_mask = 0x1<<1;
-static const word_t prev_min_mask= 0x1<<2;
-static const word_t size_mask = ~(word_t)0xF;
+static const tag_t alloc_mask = 0x1;
+static const tag_t prev_alloc_mask = 0x1<<1;
+static const tag_t prev_min_mask= 0x1<<2;
+static const tag_t size_mask = ~(tag_t)0xF;
 
 union min_list_header {
     void *next;
     char payload[0];
 };
 
+/* Block structs are packed: their payload starts right after the 4-byte tag */
 typedef struct min_block {
-    word_t header;
+    tag_t header;
     union min_list_header val;
-} min_block_t;
+} __attribute__((packed)) min_block_t;
 
 /** @brief Represents the header and payload of one block in the heap */
 union list_header {
@@ -119,19 +197,300 @@ union list_header {
 };
 
 typedef struct block {
-    word_t header;
+    tag_t header;
     union list_header val;
-} block_t;
+} __attribute__((packed)) block_t;
+
+/*
+ * If MM_SLAB is set to 1 (e.g. -DMM_SLAB=1), requests of at most
+ * slab_max_size bytes are served from slabs: allocated heap blocks carved into
+ * slab_slots equal-size slots, with a bitmap of the free ones. Slots carry a
+ * slot tag instead of a boundary-tag header, so allocating and freeing them
+ * never splits or coalesces.
+ */
+#ifndef MM_SLAB
+#define MM_SLAB 0
+#endif
+
+/** @brief Largest block size (bytes) served from slabs */
+static const size_t slab_max_size = 256;
+
+/** @brief Number of slots in a slab (at most 64, one bitmap word) */
+static const size_t slab_slots = 32;
+
+/* One slab class per multiple of dsize up to slab_max_size */
+#define SLAB_CLASSES 16
+
+/**
+ * Marks a slot tag; never set in a block header since sizes are multiples of
+ * 16. A tag holds the slot's byte offset from its slab in bits 16 and up, and
+ * its slot index in bits 4 to 15.
+ */
+static const tag_t slot_mask = 0x1 << 3;
+
+/**
+ * @brief Header of a slab, at the start of its heap block's payload.
+ *
+ * Bit i of map is set iff slot i is free. Slabs with at least one free slot
+ * are linked into the list of their class.
+ */
+typedef struct slab {
+    struct slab *prev;
+    struct slab *next;
+    word_t map;
+    unsigned int size;
+    unsigned int nfree;
+    unsigned int unused[3]; // puts the first slot tag 4 bytes below alignment
+} __attribute__((packed)) slab_t;
+
+_Static_assert(sizeof(slab_t) % 16 == 12, "slot payloads must be aligned");
+
+/*
+ * If MM_DEFER_COALESCE is set to 1 (the default), freed blocks of at most
+ * quick_max_size bytes are not coalesced right away. They stay marked as
+ * allocated on per-size quick lists, where requests of exactly their size
+ * reuse them, and are coalesced in one batch when find_fit fails or more than
+ * quick_limit of them have piled up.
+ */
+#ifndef MM_DEFER_COALESCE
+#define MM_DEFER_COALESCE 1
+#endif
+
+/** @brief Largest block size (bytes) whose coalescing is deferred */
+static const size_t quick_max_size = 512;
+
+/** @brief Number of quick-listed blocks that triggers a batch coalesce */
+static const size_t quick_limit = 256;
+
+/* One quick list per multiple of dsize up to quick_max_size */
+#define QUICK_BINS 32
+
+/*
+ * MM_FIT_POLICY selects how free blocks of at least tree_min_size bytes are
+ * placed. MM_FIT_BEST (the default) keeps them in a splay tree ordered by
+ * size then address, so find_fit returns the lowest-addressed best fit in
+ * logarithmic amortized time. MM_FIT_SEGREGATED keeps them in the segregated
+ * lists like every other block.
+ */
+#define MM_FIT_SEGREGATED 0
+#define MM_FIT_BEST 1
+#ifndef MM_FIT_POLICY
+#define MM_FIT_POLICY MM_FIT_BEST
+#endif
+
+/** @brief Smallest free block (bytes) kept in the tree under MM_FIT_BEST */
+static const size_t tree_min_size = (1 << 12);
+
+/** @brief A free block that is a node of the large-block tree */
+typedef struct tree_block {
+    tag_t header;
+    struct tree_block *left;
+    struct tree_block *right;
+    struct tree_block *parent;
+    size_t size; // set only in a free block too large for its tag
+} __attribute__((packed)) tree_block_t;
+
+/*
+ * If MM_ADAPTIVE_GROWTH is set to 1 (the default), the heap grows by more
+ * than chunksize bytes while it is growing often: an extension that comes
+ * within grow_window heap allocations of the previous one doubles the growth
+ * size, up to grow_max_size, and a later one halves it again. An extension
+ * never exceeds 1/grow_headroom of the heap beyond what the request needs,
+ * which bounds the space it can waste.
+ */
+#ifndef MM_ADAPTIVE_GROWTH
+#define MM_ADAPTIVE_GROWTH 1
+#endif
+
+/** @brief Heap allocations between extensions that count as a burst */
+static const size_t grow_window = 128;
+
+/** @brief Largest growth size (bytes) */
+static const size_t grow_max_size = (1 << 18);
+
+/** @brief Extensions are at most 1/grow_headroom of the heap size */
+static const size_t grow_headroom = 32;
+
+/*
+ * If MM_PREFETCH is set to 1 (the default), walks over free-list and tree
+ * links and over the quick lists issue a software prefetch for the next node
+ * before examining the current one, so the cache miss on each scattered node
+ * overlaps with the work on its predecessor instead of stalling the walk.
+ */
+#ifndef MM_PREFETCH
+#define MM_PREFETCH 1
+#endif
+
+/*
+ * If MM_FRESH_ZERO is set to 1 (the default), the heap keeps a zero window:
+ * the bytes from seg->zero_lo up to the tags at the end of the heap, which
+ * came from memory mem_fresh_lo reports as never used and have not been
+ * written since. calloc clears only the bytes of its block outside the
+ * window, and none of a block in a mapped region.
+ */
+#ifndef MM_FRESH_ZERO
+#define MM_FRESH_ZERO 1
+#endif
+
+/*
+ * Free blocks larger than min_block_size are kept in segregated lists indexed
+ * TLSF-style: sizes below 64 bytes get one class per dsize, and every power of
+ * two above that is split into SL_COUNT equal-width classes. A two-level
+ * bitmap records which classes are non-empty, so the smallest non-empty class
+ * that can satisfy a request is found with two ctz instructions.
+ */
+#define SL_BITS 2
+#define SL_COUNT (1 << SL_BITS)
+#define NUM_FL 32
+#define NUM_CLASSES (NUM_FL * SL_COUNT)
+
+/**
+ * @brief Heads and occupancy bitmaps of the segregated free lists.
+ *
+ * Bit `fl` of fl_map is set iff sl_map[fl] is non-zero, and bit `sl` of
+ * sl_map[fl] is set iff heads[fl * SL_COUNT + sl] is non-empty. The table is
+ * stored at the bottom of the heap, below the prologue, together with the
+ * lists of slabs that have free slots, the root of the large-block tree, the
+ * quick lists, the state of the growth policy and the zero window.
+ */
+typedef struct seg_table {
+    word_t fl_map;
+    unsigned char sl_map[NUM_FL];
+    block_t *heads[NUM_CLASSES];
+    slab_t *slabs[SLAB_CLASSES];
+    tree_block_t *tree_root;
+    min_block_t *quick[QUICK_BINS];
+    size_t quick_count;
+    size_t grow_size;  // current growth size (bytes)
+    size_t grow_clock; // heap allocations since the last extension
+    char *zero_lo;       // start of the zero window
+    block_t *zero_block; // block the current allocation took from free space
+    char *zero_from;     // start of zero_block's payload bytes in the window
+} seg_table_t;
+
+/*
+ * MM_STATS counts allocator events for mm_stats_dump: allocations and frees
+ * per size class, splits, coalesces by case, heap extensions and the lengths
+ * of fit searches. The emulate and msan builds compile the counters out, to
+ * stay within the driver's 128-byte limit on global data.
+ */
+#ifndef MM_STATS
+#define MM_STATS 1
+#endif
+
+#if MM_STATS
+/* Fit searches are binned by log2 of the number of candidates examined */
+#define FIT_BINS 16
+
+/**
+ * @brief Counters of allocator events, reset by mm_init.
+ *
+ * Class NUM_CLASSES of allocs and frees counts blocks in mapped regions.
+ * Bin 0 of fit_hist counts searches that examined no candidate, and bin k
+ * those that examined 2^(k-1) to 2^k - 1 candidates.
+ */
+typedef struct mm_stats {
+    uint64_t allocs[NUM_CLASSES + 1];
+    uint64_t frees[NUM_CLASSES + 1];
+    uint64_t splits;
+    uint64_t coalesces[4];
+    uint64_t extends;
+    uint64_t extend_bytes;
+    uint64_t fit_steps;
+    uint64_t fit_hist[FIT_BINS];
+} mm_stats_t;
+#endif
 
 /* Global variables */
 
-#define NUM_CLASSES 8
+/*
+ * With several arenas, the heap variables below are per thread: heap_lock
+ * loads them from the arena it locks, and heap_unlock stores them back
+ */
+#if MM_ARENAS > 1
+#define HEAP_STATE __thread __attribute__((tls_model("initial-exec")))
+#else
+#define HEAP_STATE
+#endif
+
 /** @brief Pointer to first block in the heap */
-static block_t *heap_start = NULL;
+static HEAP_STATE block_t *heap_start = NULL;
 /** @brief Pointer to last block in the heap */
-static block_t *heap_end= NULL;
-block_t *segList[NUM_CLASSES];
-min_block_t *minList[6];
+static HEAP_STATE block_t *heap_end= NULL;
+/** @brief Segregated free lists, at the bottom of the heap */
+static HEAP_STATE seg_table_t *seg = NULL;
+static HEAP_STATE min_block_t *minList[6];
+
+#if MM_STATS
+static mm_stats_t stats;
+#endif
+
+#if MM_THREAD_CACHE
+/** @brief Largest block size (bytes) served from the per-thread caches */
+static const size_t tc_max_size = 512;
+
+/** @brief Number of blocks a thread may cache per bin before flushing */
+static const size_t tc_bin_cap = 16;
+
+/* One bin per multiple of dsize up to tc_max_size */
+#define TC_BINS 32
+
+/**
+ * @brief Per-thread cache of freed small blocks.
+ *
+ * Cached blocks stay marked as allocated in the heap; they are chained
+ * through the first word of their payload. A cache whose generation does not
+ * match heap_gen belongs to a heap that has since been reinitialized, and is
+ * dropped without touching its blocks.
+ */
+typedef struct tcache {
+    unsigned long gen;
+    bool registered;
+    void *bins[TC_BINS];
+    unsigned char count[TC_BINS];
+} tcache_t;
+
+#if MM_ARENAS > 1
+/** @brief Bytes of address space mapped for each arena but arena 0 */
+static const size_t arena_size = (1 << 24);
+
+/**
+ * @brief An independent heap, with the lock that protects it.
+ *
+ * The heap variables of an arena are only up to date while no thread holds
+ * its lock. Arena 0 is the memlib heap; the others live in a region of their
+ * own, whose break is brk and whose bytes from fresh up were never used.
+ */
+typedef struct arena {
+    pthread_mutex_t lock;
+    block_t *heap_start;
+    block_t *heap_end;
+    seg_table_t *seg;
+    min_block_t *minList[6];
+    char *lo;
+    char *brk;
+    char *fresh;
+} arena_t;
+
+static arena_t arenas[MM_ARENAS] = {
+    [0 ... MM_ARENAS - 1] = {.lock = PTHREAD_MUTEX_INITIALIZER}};
+/** @brief Number of threads given an arena so far */
+static unsigned long arena_next = 0;
+/** @brief The arena the calling thread allocates from */
+static __thread arena_t *home_arena __attribute__((tls_model("initial-exec")));
+/** @brief The arena whose lock the calling thread holds */
+static __thread arena_t *held_arena __attribute__((tls_model("initial-exec")));
+#else
+/** @brief Protects every structure of the shared heap */
+static pthread_mutex_t heap_mutex = PTHREAD_MUTEX_INITIALIZER;
+#endif
+/** @brief Bumped by mm_init to invalidate all thread caches */
+static unsigned long heap_gen = 0;
+/** @brief Key whose destructor flushes a thread's cache when it exits */
+static pthread_key_t tc_key;
+static pthread_once_t tc_key_once = PTHREAD_ONCE_INIT;
+static __thread tcache_t tcache __attribute__((tls_model("initial-exec")));
+#endif
 
 /*
  *****************************************************************************
@@ -173,6 +532,108 @@ static size_t round_up(size_t size, size_t n) {
     return n * ((size + (n - 1)) / n);
 }
 
+/**
+ * @brief Extends the heap of the held arena by incr bytes.
+ *
+ * Arena 0 grows with mem_sbrk; any other arena moves a break within its
+ * region, mapping the region on first use. A negative incr shrinks the heap.
+ *
+ * @param[in] incr The amount of bytes by which to extend the heap
+ * @return The previous break, or (void *)-1 if the heap cannot grow
+ */
+static void *arena_sbrk(intptr_t incr) {
+#if MM_ARENAS > 1
+    arena_t *arena = held_arena;
+    if (arena != &arenas[0]) {
+        if (arena->lo == NULL) {
+            char *region = mem_map(arena_size);
+            if (region == (void *)-1) {
+                return (void *)-1;
+            }
+            arena->brk = arena->fresh = region;
+            __atomic_store_n(&arena->lo, region, __ATOMIC_RELEASE);
+        }
+        if (incr > arena->lo + arena_size - arena->brk) {
+            return (void *)-1;
+        }
+        char *old_brk = arena->brk;
+        arena->brk += incr;
+        if (arena->brk > arena->fresh) {
+            arena->fresh = arena->brk;
+        }
+        return old_brk;
+    }
+#endif
+    return mem_sbrk(incr);
+}
+
+/**
+ * @brief Finds the low address of the held arena's heap.
+ * @return The address of the first byte of the heap
+ */
+static void *arena_lo(void) {
+#if MM_ARENAS > 1
+    if (held_arena != &arenas[0]) {
+        return held_arena->lo;
+    }
+#endif
+    return mem_heap_lo();
+}
+
+/**
+ * @brief Finds the high address of the held arena's heap.
+ * @return The address of the last byte of the heap
+ */
+static void *arena_hi(void) {
+#if MM_ARENAS > 1
+    if (held_arena != &arenas[0]) {
+        return held_arena->brk - 1;
+    }
+#endif
+    return mem_heap_hi();
+}
+
+/**
+ * @brief Returns the number of bytes in the held arena's heap.
+ * @return The size of the heap, in bytes
+ */
+static size_t arena_heapsize(void) {
+#if MM_ARENAS > 1
+    if (held_arena != &arenas[0]) {
+        return (size_t)(held_arena->brk - held_arena->lo);
+    }
+#endif
+    return mem_heapsize();
+}
+
+/**
+ * @brief Returns where memory that the held arena's heap never held begins.
+ * @return The heap's high-water mark, or NULL as mem_fresh_lo
+ */
+static void *arena_fresh_lo(void) {
+#if MM_ARENAS > 1
+    if (held_arena != &arenas[0]) {
+        // Mapped regions start out zero exactly when fresh heap memory does
+        return mem_fresh_lo() == NULL ? NULL : held_arena->fresh;
+    }
+#endif
+    return mem_fresh_lo();
+}
+
+/**
+ * @brief Hints that the word at `p` will be read soon.
+ *
+ * A no-op unless MM_PREFETCH is set. `p` may be NULL or any other address
+ * that is not dereferenced, since a prefetch never faults.
+ *
+ * @param[in] p
+ */
+static void prefetch(const void *p) {
+#if MM_PREFETCH
+    __builtin_prefetch(p);
+#endif
+}
+
 /**
  * @brief Packs the `size` and `alloc` of a block into a word suitable for
  *        use as a packed value.
@@ -185,8 +646,9 @@ static size_t round_up(size_t size, size_t n) {
  * @param[in] alloc True if the block is allocated
  * @return The packed value
  */
-static word_t pack(size_t size, bool prev_min, bool prev_alloc, bool alloc) {
-    word_t word = size;
+static tag_t pack(size_t size, bool prev_min, bool prev_alloc, bool alloc) {
+    dbg_requires(size <= max_tag_size);
+    tag_t word = (tag_t)size;
     if (prev_min) {
         word |= prev_min_mask;
     }
@@ -210,7 +672,7 @@ static word_t pack(size_t size, bool prev_min, bool prev_alloc, bool alloc) {
  * @param[in] word
  * @return The size of the block represented by the word
  */
-static size_t extract_size(word_t word) {
+static size_t extract_size(tag_t word) {
     return (word & size_mask);
 }
 
@@ -220,7 +682,11 @@ static size_t extract_size(word_t word) {
  * @return The size of the block
  */
 static size_t get_size(block_t *block) {
-    return extract_size(block->header);
+    size_t size = extract_size(block->header);
+    if (size == 0 && !(block->header & alloc_mask)) {
+        return ((tree_block_t *)block)->size;
+    }
+    return size;
 }
 
 /**
@@ -241,7 +707,7 @@ static block_t *payload_to_header(void *bp) {
  * @pre The block must be a valid block, not a boundary tag.
  */
 static void *header_to_payload(block_t *block) {
-    dbg_requires(get_size(block) != 0);
+    dbg_requires(block->header != pack(0, false, false, true));
     return (void *)(block->val.payload);
 }
 
@@ -252,10 +718,10 @@ static void *header_to_payload(block_t *block) {
  * @return A pointer to the block's footer
  * @pre The block must be a valid block, not a boundary tag.
  */
-static word_t *header_to_footer(block_t *block) {
+static tag_t *header_to_footer(block_t *block) {
     if(get_size(block) == 0) printf("called header_to_footer on epilogue\n");
     //dbg_requires(get_size(block) != 0 && "Called header_to_footer on the epilogue block");
-    return (word_t *)(block->val.payload + get_size(block) - dsize);
+    return (tag_t *)((char *)block + get_size(block) - tsize);
 }
 
 /**
@@ -265,24 +731,86 @@ static word_t *header_to_footer(block_t *block) {
  * @return A pointer to the start of the block
  * @pre The footer must be the footer of a valid block, not a boundary tag.
  */
-static block_t *footer_to_header(word_t *footer) {
+static block_t *footer_to_header(tag_t *footer) {
     size_t size = extract_size(*footer);
+    if (size == 0) {
+        size = *(size_t *)((char *)footer - wsize);
+    }
     dbg_assert(size != 0 && "Called footer_to_header on the prologue block");
-    return (block_t *)((char *)footer + wsize - size);
+    return (block_t *)((char *)footer + tsize - size);
+}
+
+/**
+ * @brief Returns whether a "block" is really a slab slot.
+ * @param[in] block The header word preceding a payload
+ * @return True if the word is a slot tag
+ */
+static bool is_slot(block_t *block) {
+    return (bool)(block->header & slot_mask);
+}
+
+/**
+ * @brief Returns whether an allocated block lives in a mapped region.
+ * @param[in] block An allocated block or slot
+ * @return True if the block lies outside of the heap
+ */
+static bool is_mapped(block_t *block) {
+    return (word_t)block < (word_t)heap_start ||
+           (word_t)block > (word_t)heap_end;
+}
+
+/**
+ * @brief Given a mapped block, returns the start of its region.
+ *
+ * The region's first word holds its size, since a mapped block may be too
+ * large for its tag; the tag itself carries a size of 0.
+ *
+ * @param[in] block A block in a mapped region
+ * @return The first word of the region
+ */
+static word_t *block_to_region(block_t *block) {
+    return (word_t *)((char *)block + tsize - dsize);
+}
+
+/**
+ * @brief Given a slot, returns the slab containing it.
+ * @param[in] block A slot tag
+ * @return The slab header
+ */
+static slab_t *slot_to_slab(block_t *block) {
+    return (slab_t *)((char *)block - (block->header >> 16));
+}
+
+/**
+ * @brief Returns the size of a block or slot, including its header.
+ * @param[in] block A block or slot
+ * @return The number of bytes the block occupies
+ */
+static size_t get_block_size(block_t *block) {
+    if (is_slot(block)) {
+        return slot_to_slab(block)->size;
+    }
+    size_t size = get_size(block);
+    if (size == 0) {
+        // of allocated blocks, only mapped ones have a tag of size 0
+        return *block_to_region(block) - (dsize - tsize);
+    }
+    return size;
 }
 
 /**
  * @brief Returns the payload size of a given block.
  *
- * The payload size is equal to the entire block size minus the sizes of the
- * block's header and footer.
+ * The payload size is equal to the entire block size minus the size of the
+ * block's header, as allocated blocks have no footer. The block may be a slab
+ * slot or a mapped block.
  *
  * @param[in] block
  * @return The size of the block's payload
  */
 static size_t get_payload_size(block_t *block) {
-    size_t asize = get_size(block);
-    return asize - wsize;
+    size_t asize = get_block_size(block);
+    return asize - tsize;
 }
 
 /**
@@ -293,15 +821,15 @@ static size_t get_payload_size(block_t *block) {
  * @param[in] word
  * @return The allocation status correpsonding to the word
  */
-static bool extract_alloc(word_t word) {
+static bool extract_alloc(tag_t word) {
     return (bool)(word & alloc_mask);
 }
 
-static bool extract_prev_alloc(word_t word) {
+static bool extract_prev_alloc(tag_t word) {
     return (bool)(word & prev_alloc_mask);
 }
 
-static bool extract_prev_min(word_t word) {
+static bool extract_prev_min(tag_t word) {
     return (bool)(word & prev_min_mask);
 }
 
@@ -331,7 +859,7 @@ static bool get_prev_min(block_t *block) {
  */
 static void write_epilogue(block_t *block) {
     dbg_requires(block != NULL);
-    dbg_requires((char *)block == mem_heap_hi() - 7);
+    dbg_requires((char *)block == (char *)arena_hi() - 3);
     block->header = pack(0, false, false, true);
 }
 
@@ -353,11 +881,18 @@ static void write_block(block_t *block, size_t size, bool prev_min_status, bool
 
     //bool prev_alloc_status= get_prev_alloc(block);
     //bool prev_min_status= get_prev_min(block);
-    block->header= pack(size, prev_min_status, prev_alloc_status, alloc);
+    size_t tag_size = size;
+    if (size > max_tag_size) {
+        dbg_requires(!alloc);
+        tag_size = 0;
+        ((tree_block_t *)block)->size = size;
+        *(size_t *)((char *)block + size - tsize - wsize) = size;
+    }
+    block->header= pack(tag_size, prev_min_status, prev_alloc_status, alloc);
 
     if(!alloc &&  size != min_block_size){
-        word_t *footerp = header_to_footer(block);
-        *footerp = pack(size, prev_min_status, prev_alloc_status, alloc);
+        tag_t *footerp = header_to_footer(block);
+        *footerp = pack(tag_size, prev_min_status, prev_alloc_status, alloc);
     }
 }
 
@@ -383,9 +918,9 @@ static block_t *find_next(block_t *block) {
  * @param[in] block A block in the heap
  * @return The location of the previous block's footer
  */
-static word_t *find_prev_footer(block_t *block) {
-    // Compute previous footer position as one word before the header
-    return &(block->header) - 1;
+static tag_t *find_prev_footer(block_t *block) {
+    // Compute previous footer position as one tag before the header
+    return (tag_t *)((char *)block - tsize);
 }
 
 /**
@@ -405,10 +940,10 @@ static word_t *find_prev_footer(block_t *block) {
  */
 static block_t *find_prev(block_t *block) {
     dbg_requires(block != NULL);
-    word_t *footerp = find_prev_footer(block);
+    tag_t *footerp = find_prev_footer(block);
 
     // Return NULL if called on first block in the heap
-    if (extract_size(*footerp) == 0) {
+    if (extract_size(*footerp) == 0 && extract_alloc(*footerp)) {
         return NULL;
     }
 
@@ -481,26 +1016,250 @@ void push_min_block(min_block_t *block){
     minList[index]= block;
 }
 
-//gets the index into the segList based on size for appropriate size class
+//gets the index into the segList based on size for appropriate size class:
+//one class per dsize below 64 bytes, then SL_COUNT classes per power of two;
+//blocks of 2^(NUM_FL + 5) bytes or more all share the last class
 size_t get_index(size_t asize) {
-    size_t index = 0;
     if (asize < (1 << 6))
-        index = 0;
-    if (asize >= (1 << 6) && asize < (1 << 7))
-        index = 1;
-    if (asize >= (1 << 7) && asize < (1 << 8))
-        index = 2;
-    if (asize >= (1 << 8) && asize < (1 << 9))
-        index = 3;
-    if (asize >= (1 << 9) && asize < (1 << 10))
-        index = 4;
-    if (asize >= (1 << 10) && asize < (1 << 11))
-        index = 5;
-    if (asize >= (1 << 11) && asize < (1 << 12))
-        index = 6;
-    if (asize >= (1 << 12))
-        index = 7;
-    return index;
+        return asize / dsize;
+
+    size_t lg = 63 - (size_t)__builtin_clzl(asize);
+    size_t fl = lg - 5;
+    if (fl >= NUM_FL)
+        return NUM_CLASSES - 1;
+
+    size_t sl = (asize >> (lg - SL_BITS)) & (SL_COUNT - 1);
+    return fl * SL_COUNT + sl;
+}
+
+// marks class i as non-empty in both bitmap levels
+static void set_class_bit(size_t i) {
+    size_t fl = i >> SL_BITS;
+    seg->sl_map[fl] |= (unsigned char)(1 << (i & (SL_COUNT - 1)));
+    seg->fl_map |= (word_t)1 << fl;
+}
+
+// marks class i as empty, clearing its row in fl_map once the row is empty
+static void clear_class_bit(size_t i) {
+    size_t fl = i >> SL_BITS;
+    seg->sl_map[fl] &= (unsigned char)~(1 << (i & (SL_COUNT - 1)));
+    if (seg->sl_map[fl] == 0)
+        seg->fl_map &= ~((word_t)1 << fl);
+}
+
+// returns the smallest non-empty class >= i, or NUM_CLASSES if there is none
+static size_t find_class(size_t i) {
+    if (i >= NUM_CLASSES)
+        return NUM_CLASSES;
+
+    size_t fl = i >> SL_BITS;
+    word_t sl_bits = seg->sl_map[fl] & (~(word_t)0 << (i & (SL_COUNT - 1)));
+    if (sl_bits == 0) {
+        word_t fl_bits = seg->fl_map & (~(word_t)0 << (fl + 1));
+        if (fl_bits == 0)
+            return NUM_CLASSES;
+        fl = (size_t)__builtin_ctzl(fl_bits);
+        sl_bits = seg->sl_map[fl];
+    }
+    return fl * SL_COUNT + (size_t)__builtin_ctzl(sl_bits);
+}
+
+/*
+ * Event counters for mm_stats_dump. They compile to nothing unless MM_STATS
+ * is set; callers hold the heap lock, which with several arenas does not
+ * keep out threads updating the counters from other arenas.
+ */
+
+#if MM_STATS
+// adds n to an event counter
+static void count_add(uint64_t *counter, uint64_t n) {
+#if MM_ARENAS > 1
+    __atomic_fetch_add(counter, n, __ATOMIC_RELAXED);
+#else
+    *counter += n;
+#endif
+}
+#endif
+
+// counts the allocation of a block, slot or mapped block
+static void count_alloc(block_t *block) {
+#if MM_STATS
+    count_add(&stats.allocs[is_mapped(block) ? NUM_CLASSES
+                                             : get_index(get_block_size(block))],
+              1);
+#endif
+}
+
+// counts the freeing of a block, slot or mapped block
+static void count_free(block_t *block) {
+#if MM_STATS
+    count_add(&stats.frees[is_mapped(block) ? NUM_CLASSES
+                                            : get_index(get_block_size(block))],
+              1);
+#endif
+}
+
+// counts a block split in two by placement or resizing
+static void count_split(void) {
+#if MM_STATS
+    count_add(&stats.splits, 1);
+#endif
+}
+
+// counts a coalesce of case c, numbered as in coalesce_block
+static void count_coalesce(int c) {
+#if MM_STATS
+    count_add(&stats.coalesces[c - 1], 1);
+#endif
+}
+
+// counts a successful extend_heap by size bytes
+static void count_extend(size_t size) {
+#if MM_STATS
+    count_add(&stats.extends, 1);
+    count_add(&stats.extend_bytes, size);
+#endif
+}
+
+// counts a fit search that examined steps candidate blocks or lists
+static void count_fit(size_t steps) {
+#if MM_STATS
+    size_t bin = steps == 0 ? 0 : (size_t)(64 - __builtin_clzl(steps));
+    count_add(&stats.fit_hist[bin < FIT_BINS ? bin : FIT_BINS - 1], 1);
+    count_add(&stats.fit_steps, steps);
+#endif
+}
+
+/*
+ * The large-block tree is the splay tree of stree.c, with the nodes stored in
+ * the free blocks themselves and keyed by (size, address).
+ */
+
+// orders tree nodes by size, then by address
+static bool tree_less(tree_block_t *x, tree_block_t *y) {
+    size_t x_size = get_size((block_t *)x);
+    size_t y_size = get_size((block_t *)y);
+    return x_size < y_size || (x_size == y_size && (word_t)x < (word_t)y);
+}
+
+// makes v take u's place below u's parent
+static void tree_replace(tree_block_t *u, tree_block_t *v) {
+    if (u->parent == NULL)
+        seg->tree_root = v;
+    else if (u == u->parent->left)
+        u->parent->left = v;
+    else
+        u->parent->right = v;
+    if (v != NULL)
+        v->parent = u->parent;
+}
+
+static void tree_left_rotate(tree_block_t *x) {
+    tree_block_t *y = x->right;
+    x->right = y->left;
+    if (y->left != NULL)
+        y->left->parent = x;
+    tree_replace(x, y);
+    y->left = x;
+    x->parent = y;
+}
+
+static void tree_right_rotate(tree_block_t *x) {
+    tree_block_t *y = x->left;
+    x->left = y->right;
+    if (y->right != NULL)
+        y->right->parent = x;
+    tree_replace(x, y);
+    y->right = x;
+    x->parent = y;
+}
+
+// moves x to the root of the tree
+static void tree_splay(tree_block_t *x) {
+    while (x->parent != NULL) {
+        tree_block_t *p = x->parent;
+        tree_block_t *g = p->parent;
+        if (g == NULL) {
+            if (p->left == x)
+                tree_right_rotate(p);
+            else
+                tree_left_rotate(p);
+        } else if (p->left == x && g->left == p) {
+            tree_right_rotate(g);
+            tree_right_rotate(p);
+        } else if (p->right == x && g->right == p) {
+            tree_left_rotate(g);
+            tree_left_rotate(p);
+        } else if (p->left == x) {
+            tree_right_rotate(p);
+            tree_left_rotate(g);
+        } else {
+            tree_left_rotate(p);
+            tree_right_rotate(g);
+        }
+    }
+}
+
+// inserts a free block into the large-block tree
+static void tree_insert(block_t *block) {
+    tree_block_t *z = (tree_block_t *)block;
+    tree_block_t *p = NULL;
+    for (tree_block_t *x = seg->tree_root; x != NULL;) {
+        p = x;
+        x = tree_less(z, x) ? x->left : x->right;
+    }
+
+    z->left = NULL;
+    z->right = NULL;
+    z->parent = p;
+    if (p == NULL)
+        seg->tree_root = z;
+    else if (tree_less(z, p))
+        p->left = z;
+    else
+        p->right = z;
+    tree_splay(z);
+}
+
+// removes a free block from the large-block tree
+static void tree_remove(block_t *block) {
+    tree_block_t *z = (tree_block_t *)block;
+    tree_splay(z);
+    if (z->left == NULL) {
+        tree_replace(z, z->right);
+    } else if (z->right == NULL) {
+        tree_replace(z, z->left);
+    } else {
+        tree_block_t *y = z->right;
+        while (y->left != NULL)
+            y = y->left;
+        if (y->parent != z) {
+            tree_replace(y, y->right);
+            y->right = z->right;
+            y->right->parent = y;
+        }
+        tree_replace(z, y);
+        y->left = z->left;
+        y->left->parent = y;
+    }
+}
+
+// returns the smallest, then lowest-addressed, block of at least asize
+// bytes in the large-block tree, or NULL if there is none. Adds the number
+// of nodes visited to *steps
+static block_t *tree_best_fit(size_t asize, size_t *steps) {
+    tree_block_t *best = NULL;
+    for (tree_block_t *x = seg->tree_root; x != NULL; (*steps)++) {
+        prefetch(x->left);
+        prefetch(x->right);
+        if (get_size((block_t *)x) >= asize) {
+            best = x;
+            x = x->left;
+        } else {
+            x = x->right;
+        }
+    }
+    return (block_t *)best;
 }
 
 // removes the inputted block from the appropriate "root" (i.e index into the
@@ -514,18 +1273,25 @@ void pop(block_t *block) {
         pop_min_block((min_block_t*)block);
         return;
     }
+    if (MM_FIT_POLICY == MM_FIT_BEST && size >= tree_min_size) {
+        tree_remove(block);
+        return;
+    }
 
     size_t i = get_index(size);
-    block_t *root = segList[i];
+    block_t *root = seg->heads[i];
     dbg_requires(root != NULL);
 
     block_t *prev_block = (block_t *)block->val.list.prev;
     block_t *next_block = (block_t *)block->val.list.next;
+    prefetch(prev_block);
+    prefetch(next_block);
 
     // one ele
     if ((word_t)block == (word_t)root && prev_block == NULL &&
         next_block == NULL) {
-        segList[i] = NULL;
+        seg->heads[i] = NULL;
+        clear_class_bit(i);
         return;
     }
 
@@ -534,7 +1300,7 @@ void pop(block_t *block) {
         prev_block == NULL) {
         next_block->val.list.prev = NULL;
         block->val.list.next = NULL;
-        segList[i] = next_block;
+        seg->heads[i] = next_block;
         return;
     }
 
@@ -552,7 +1318,7 @@ void pop(block_t *block) {
         prev_block == NULL) {
         next_block->val.list.prev = NULL;
         block->val.list.next = NULL;
-        segList[i] = next_block;
+        seg->heads[i] = next_block;
         return;
     }
 
@@ -591,14 +1357,19 @@ void push(block_t *block) {
         push_min_block((min_block_t*)block);
         return;
     }
+    if (MM_FIT_POLICY == MM_FIT_BEST && size >= tree_min_size) {
+        tree_insert(block);
+        return;
+    }
 
     size_t i = get_index(size);
-    block_t *root = segList[i];
+    block_t *root = seg->heads[i];
 
     if (root == NULL) {
         block->val.list.prev = NULL;
         block->val.list.next = NULL;
-        segList[i] = block;
+        seg->heads[i] = block;
+        set_class_bit(i);
         return;
     }
     dbg_assert(root->val.list.prev == NULL);
@@ -607,7 +1378,7 @@ void push(block_t *block) {
     block->val.list.next = (void *)root;
     block->val.list.prev = NULL;
 
-    segList[i] = block;
+    seg->heads[i] = block;
 }
 
 // adds and coalesces an inputted block with other blocks by popping and pushing */
@@ -622,27 +1393,31 @@ static block_t *coalesce_block(block_t *block) {
     size_t size = get_size(block);
     bool c= get_prev_min(block);
 
-    word_t *tmp= (word_t*)block - 1;
+    tag_t *tmp= find_prev_footer(block);
     if (*tmp == (word_t)0x1 && (word_t)tmp == (word_t)heap_start && (word_t)(next_block->header) != (word_t)0x1) {
         if (!get_alloc(next_block)) {
             pop(next_block);
             write_block(block, size + next_size, get_prev_min(block), get_prev_alloc(block),false);
             push(block);
+            count_coalesce(2);
             return block;
         }
         push(block);
+        count_coalesce(1);
         return block;
     }
 
-    dbg_assert(next_block->header != (word_t)0x1);
-
-    bool nnext_valid= true;
-    block_t *next_next= find_next(next_block);
-    if((word_t)next_next->header == (word_t)0x1)
-        nnext_valid= false;
+    // the freed block may be heap_end, with only the epilogue after it
+    bool nnext_valid= false;
+    block_t *next_next= next_block;
+    if((word_t)next_block->header != (word_t)0x1){
+        next_next= find_next(next_block);
+        nnext_valid= (word_t)next_next->header != (word_t)0x1;
+    }
 
     // case 1: Allocated | just_freed | Allocated
     if (get_prev_alloc(block) && get_alloc(next_block)) {
+        count_coalesce(1);
         push(block);
         dbg_assert(mm_checkheap(__LINE__));
         return block;
@@ -650,6 +1425,7 @@ static block_t *coalesce_block(block_t *block) {
 
     // case 2: Allocated | just_freed | Free
     if (get_prev_alloc(block) && !get_alloc(next_block)) {
+        count_coalesce(2);
 
         pop(next_block);
         write_block(block, size + next_size, get_prev_min(block), get_prev_alloc(block), false);
@@ -667,10 +1443,10 @@ static block_t *coalesce_block(block_t *block) {
 
     // case 3: Free | just_freed | Allocated
     if (!get_prev_alloc(block) && get_alloc(next_block)) {
+        count_coalesce(3);
         block_t *prev_block;
         if(c){
-            word_t *tmp= (word_t*)block - 2;
-            prev_block= (block_t*)tmp;
+            prev_block= (block_t*)((char*)block - min_block_size);
         }else{
             prev_block= find_prev(block);
         }
@@ -684,6 +1460,8 @@ static block_t *coalesce_block(block_t *block) {
         write_block(prev_block, prev_size + size, get_prev_min(prev_block), get_prev_alloc(prev_block), false);
         push(prev_block);
 
+        if((word_t)block == (word_t)heap_end)
+            heap_end= prev_block;
 
         dbg_assert(mm_checkheap(__LINE__));
         return prev_block;
@@ -691,10 +1469,10 @@ static block_t *coalesce_block(block_t *block) {
 
     // case 4: Free | just_freed | Free
     if (!get_prev_alloc(block) && !get_alloc(next_block)) {
+        count_coalesce(4);
         block_t *prev_block;
         if(c){
-            word_t *tmp= (word_t*)block - 2;
-            prev_block= (block_t*)tmp;
+            prev_block= (block_t*)((char*)block - min_block_size);
         }else{
             prev_block= find_prev(block);
         }
@@ -726,16 +1504,27 @@ static block_t *extend_heap(size_t size) {
     void *bp;
 
     size = round_up(size, dsize);
-    if ((bp = mem_sbrk(size)) == (void *)-1) {
+    char *fresh = arena_fresh_lo();
+    if ((bp = arena_sbrk((intptr_t)size)) == (void *)-1) {
         return NULL;
     }
+    count_extend(size);
 
-    block_t *block = (block_t *)payload_to_header(bp);
+    // The window restarts past the old end tags and the links the new free
+    // block may get, or is empty if the new memory was used before
+    char *zero_lo = (char *)bp + size;
+    if (MM_FRESH_ZERO && fresh != NULL && fresh < zero_lo) {
+        zero_lo = (fresh > (char *)bp ? fresh : (char *)bp) + sizeof(tree_block_t);
+    }
+    if (zero_lo > seg->zero_lo) {
+        seg->zero_lo = zero_lo;
+    }
 
-    //no ele
-    word_t *tmp= (word_t*)(block)-1;
-    word_t *tmp1= (word_t*)(block);
-    if(*tmp == (word_t)0x1 && *tmp1 == (word_t)0x1){
+    block_t *block = (block_t *)payload_to_header(bp);
+
+    //no ele: heap_end still points at the old epilogue. (The word before the
+    //epilogue can't tell, it may be stale payload data that happens to be 0x1)
+    if((word_t)heap_end == (word_t)block){
         //block->header |= prev_alloc_mask;
         //block->header &= ~prev_min_mask;
         write_block(block, size, false, true, false);
@@ -782,48 +1571,67 @@ static block_t *extend_heap(size_t size) {
     dbg_assert(0);
 }
 
-// scans the appropriate segList's free list with a first fit algorithm, to find
-// a block of the requested size or greater
+// scans the request's own size class first fit, since its members may be
+// smaller than asize; otherwise every block of a larger class fits, so the
+// bitmap gives the head of the smallest non-empty one in constant time.
+// Under MM_FIT_BEST, large requests and those no class can serve go to the
+// large-block tree
 static block_t *find_fit(size_t asize) {
+    size_t steps = 0; // lists and blocks examined, for count_fit
+    block_t *fit = NULL;
+
     if(asize == min_block_size){
-        for(int i=0; i<6; i++){
-            min_block_t *tmp1= minList[i];
-            if(tmp1 != NULL) return (block_t*)tmp1;
+        for(int i=0; i<6 && fit == NULL; i++, steps++){
+            fit= (block_t*)minList[i];
         }
     }
 
-    size_t start_index = get_index(asize);
-    for (size_t i = start_index; i < NUM_CLASSES; i++) {
-        block_t *root = segList[i];
-        if (root == NULL)
-            continue;
-        block_t *tmp = root;
-        do {
+    if (fit == NULL && MM_FIT_POLICY == MM_FIT_BEST && asize >= tree_min_size) {
+        fit = tree_best_fit(asize, &steps);
+    } else if (fit == NULL) {
+        size_t index = get_index(asize);
+        for (block_t *tmp = seg->heads[index]; tmp != NULL && fit == NULL;
+             tmp = (block_t *)tmp->val.list.next, steps++) {
+            prefetch(tmp->val.list.next);
             if (asize <= get_size(tmp)) {
-                return tmp;
+                fit = tmp;
             }
-            tmp = (block_t *)tmp->val.list.next;
+        }
 
-        } while ((word_t)tmp != 0x0);
+        if (fit == NULL) {
+            index = find_class(index + 1);
+            if (index < NUM_CLASSES) {
+                fit = seg->heads[index];
+                steps++;
+            } else if (MM_FIT_POLICY == MM_FIT_BEST) {
+                fit = tree_best_fit(asize, &steps);
+            }
+        }
     }
-    return NULL;
+
+    count_fit(steps);
+    return fit;
 }
 
-// checks the heap for correctness, for debugging purposes, once using the
-// implicit list to travel the heap, once scanning all segLists and checking if
-// the free-lists are correctly implemented
-bool mm_checkheap(int line) {
+// checks the held heap for correctness, for debugging purposes, once using
+// the implicit list to travel the heap, once scanning all segLists and checking
+// if the free-lists are correctly implemented
+static bool check_heap(int line) {
+    // an arena that has not been touched yet has no heap to check
+    if (heap_start == NULL) {
+        return true;
+    }
+
     // check prologue
-    word_t *tmp1 = (word_t *)heap_start;
-    if ((word_t)(*(tmp1 - 1)) != (word_t)0x1) {
+    if ((word_t)(*find_prev_footer(heap_start)) != (word_t)0x1) {
         printf("prologue missing\n");
         return false;
     }
 
     block_t *block;
 
-    word_t heap_hi = (word_t)mem_heap_hi();
-    word_t heap_lo = (word_t)mem_heap_lo();
+    word_t heap_hi = (word_t)arena_hi();
+    word_t heap_lo = (word_t)arena_lo();
 
     int free_blocks = 0;
     int free_list_blocks = 0;
@@ -834,7 +1642,7 @@ bool mm_checkheap(int line) {
     for (block = heap_start; get_size(block) > 0; block = find_next(block)) {
         printf("%p => ", block);
 
-        if ((word_t)block % (word_t)wsize != 0) {
+        if ((word_t)block % (word_t)dsize != dsize - tsize) {
             printf("unaligned addreses %zu (mm.c:%d)\n",
                    (word_t)block % (word_t)dsize, line);
             return false;
@@ -848,9 +1656,9 @@ bool mm_checkheap(int line) {
 
         //only free (non min_) blocks have footers
         if(!get_alloc(block) && get_size(block) != min_block_size){
-            word_t *footer = header_to_footer(block);
+            tag_t *footer = header_to_footer(block);
 
-            if (extract_size(*footer) != get_size(block)) {
+            if (extract_size(*footer) != extract_size(block->header)) {
                 printf("footer header size mismatch\n");
                 return false;
             }
@@ -925,8 +1733,15 @@ bool mm_checkheap(int line) {
 
 
     //check segList
-    for (int i = 0; i < NUM_CLASSES; i++) {
-        block_t *root = segList[i];
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        block_t *root = seg->heads[i];
+        size_t fl = i >> SL_BITS;
+        bool sl_bit = (seg->sl_map[fl] >> (i & (SL_COUNT - 1))) & 1;
+        bool fl_bit = (seg->fl_map >> fl) & 1;
+        if (sl_bit != (root != NULL) || fl_bit != (seg->sl_map[fl] != 0)) {
+            printf("class %zu bitmap out of sync (mm.c:%d)\n", i, line);
+            return false;
+        }
         if (root == NULL) {
             //printf("root%d null @ %d\n", i, line);
             continue;
@@ -954,6 +1769,12 @@ bool mm_checkheap(int line) {
                 return false;
             }
 
+            if (get_index(get_size(tmp)) != i) {
+                printf("block %p in wrong size class (mm.c:%d)\n", tmp,
+                       line);
+                return false;
+            }
+
             if (tmp != root && next_block != NULL) {
                 if (next_block->val.list.prev != prev_block->val.list.next) {
                     printf("error here\n");
@@ -968,6 +1789,85 @@ bool mm_checkheap(int line) {
         //printf("\n");
     }
 
+    //check large-block tree: an in-order walk must visit free, large blocks
+    //in increasing order, with every child linked back to its parent
+    tree_block_t *node = seg->tree_root;
+    tree_block_t *last = NULL;
+    if (node != NULL && node->parent != NULL) {
+        printf("tree root has a parent (mm.c:%d)\n", line);
+        return false;
+    }
+    while (node != NULL && node->left != NULL)
+        node = node->left;
+    while (node != NULL) {
+        if ((node->left != NULL && node->left->parent != node) ||
+            (node->right != NULL && node->right->parent != node)) {
+            printf("tree link mismatch at %p (mm.c:%d)\n", node, line);
+            return false;
+        }
+        if (get_alloc((block_t *)node) ||
+            get_size((block_t *)node) < tree_min_size ||
+            (last != NULL && !tree_less(last, node))) {
+            printf("bad tree node %p (mm.c:%d)\n", node, line);
+            return false;
+        }
+        free_list_blocks++;
+        last = node;
+
+        if (node->right != NULL) {
+            node = node->right;
+            while (node->left != NULL)
+                node = node->left;
+        } else {
+            while (node->parent != NULL && node == node->parent->right)
+                node = node->parent;
+            node = node->parent;
+        }
+    }
+
+    //check quick lists
+    size_t quick_count = 0;
+    for (size_t i = 0; i < QUICK_BINS; i++) {
+        for (min_block_t *m = seg->quick[i]; m != NULL; m = m->val.next) {
+            if (!get_alloc((block_t *)m) ||
+                get_size((block_t *)m) != (i + 1) * dsize) {
+                printf("bad quick list entry %p (mm.c:%d)\n", m, line);
+                return false;
+            }
+            quick_count++;
+        }
+    }
+    if (quick_count != seg->quick_count) {
+        printf("quick list count mismatch (mm.c:%d)\n", line);
+        return false;
+    }
+
+    //check slabs
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        slab_t *prev_slab = NULL;
+        for (slab_t *slab = seg->slabs[i]; slab != NULL; slab = slab->next) {
+            block_t *chunk = payload_to_header(slab);
+            if ((word_t)chunk >= heap_hi || (word_t)chunk <= heap_lo ||
+                !get_alloc(chunk)) {
+                printf("slab %p is not an allocated block (mm.c:%d)\n",
+                       slab, line);
+                return false;
+            }
+            if (slab->size != (i + 1) * dsize || slab->prev != prev_slab) {
+                printf("slab %p in wrong list (mm.c:%d)\n", slab, line);
+                return false;
+            }
+            size_t nfree = (size_t)__builtin_popcountl(slab->map);
+            if (nfree != slab->nfree || nfree == 0 || nfree >= slab_slots ||
+                (slab->map >> slab_slots) != 0) {
+                printf("slab %p free count mismatch (mm.c:%d)\n", slab,
+                       line);
+                return false;
+            }
+            prev_slab = slab;
+        }
+    }
+
     if (free_list_blocks != free_blocks) {
         printf("number of free blocks mismatch %d =/= %d (mm.c:%d)\n",
                free_list_blocks, free_blocks, line);
@@ -977,23 +1877,160 @@ bool mm_checkheap(int line) {
     return true;
 }
 
-// initializes a heap
-bool mm_init(void) {
-    // Create the initial empty heap
-    word_t *start = (word_t *)(mem_sbrk(2 * wsize));
+#if MM_ARENAS > 1
+// locks an arena and loads its heap variables into the calling thread's
+static void arena_enter(arena_t *arena) {
+    pthread_mutex_lock(&arena->lock);
+    held_arena = arena;
+    heap_start = arena->heap_start;
+    heap_end = arena->heap_end;
+    seg = arena->seg;
+    for (size_t i = 0; i < 6; i++) {
+        minList[i] = arena->minList[i];
+    }
+}
 
-    for(int i=0; i<NUM_CLASSES; i++){
-        segList[i]= NULL;
+// stores the calling thread's heap variables back into the held arena and
+// unlocks it
+static void arena_leave(void) {
+    arena_t *arena = held_arena;
+    arena->heap_start = heap_start;
+    arena->heap_end = heap_end;
+    arena->seg = seg;
+    for (size_t i = 0; i < 6; i++) {
+        arena->minList[i] = minList[i];
     }
+    held_arena = NULL;
+    pthread_mutex_unlock(&arena->lock);
+}
+
+// returns the arena a block or slot came from: the one whose region holds
+// it, or else arena 0, which also owns every mapped block
+static arena_t *arena_of(block_t *block) {
+    for (size_t i = 1; i < MM_ARENAS; i++) {
+        char *lo = __atomic_load_n(&arenas[i].lo, __ATOMIC_ACQUIRE);
+        if (lo != NULL && (char *)block >= lo && (char *)block < lo + arena_size)
+            return &arenas[i];
+    }
+    return &arenas[0];
+}
+#endif
+
+// takes the lock protecting the calling thread's heap (no-op unless
+// MM_THREAD_CACHE); a thread is given its arena on its first call
+static void heap_lock(void) {
+#if MM_ARENAS > 1
+    if (home_arena == NULL) {
+        unsigned long i = __atomic_fetch_add(&arena_next, 1, __ATOMIC_RELAXED);
+        home_arena = &arenas[i % MM_ARENAS];
+    }
+    arena_enter(home_arena);
+#elif MM_THREAD_CACHE
+    pthread_mutex_lock(&heap_mutex);
+#endif
+}
+
+// takes the lock protecting the heap that block came from
+static void heap_lock_block(block_t *block) {
+#if MM_ARENAS > 1
+    arena_enter(arena_of(block));
+#else
+    (void)block;
+    heap_lock();
+#endif
+}
+
+// trades the held lock for that of the heap block came from, if they differ
+static void heap_switch(block_t *block) {
+#if MM_ARENAS > 1
+    arena_t *arena = arena_of(block);
+    if (arena != held_arena) {
+        arena_leave();
+        arena_enter(arena);
+    }
+#else
+    (void)block;
+#endif
+}
+
+// trades the held lock for that of arena 0 once the held arena is full.
+// Returns false if the held arena is arena 0 already
+static bool heap_spill(void) {
+#if MM_ARENAS > 1
+    if (held_arena != &arenas[0]) {
+        arena_leave();
+        arena_enter(&arenas[0]);
+        return true;
+    }
+#endif
+    return false;
+}
+
+// releases the held heap lock
+static void heap_unlock(void) {
+#if MM_ARENAS > 1
+    arena_leave();
+#elif MM_THREAD_CACHE
+    pthread_mutex_unlock(&heap_mutex);
+#endif
+}
+
+// checks the heap for correctness. Called from outside an allocator call,
+// no arena is held, so each arena is entered and checked in turn
+bool mm_checkheap(int line) {
+#if MM_ARENAS > 1
+    if (held_arena == NULL) {
+        bool ok = true;
+        for (size_t i = 0; i < MM_ARENAS && ok; i++) {
+            arena_enter(&arenas[i]);
+            ok = check_heap(line);
+            arena_leave();
+        }
+        return ok;
+    }
+#endif
+    return check_heap(line);
+}
+
+// creates the prologue/epilogue and the first free chunk of an empty heap;
+// caller holds the heap lock
+static bool init_heap(void) {
+    // Create the initial empty heap, with the free list table below it
+    size_t table_size = round_up(sizeof(seg_table_t), dsize);
+    char *table = (char *)(arena_sbrk((intptr_t)(table_size + dsize)));
 
     for(int i=0; i<6; i++){
         minList[i]= NULL;
     }
 
-    if (start == (void *)-1) {
+    if (table == (void *)-1) {
         return false;
     }
 
+    seg = (seg_table_t *)table;
+    seg->fl_map = 0;
+    for (size_t i = 0; i < NUM_FL; i++) {
+        seg->sl_map[i] = 0;
+    }
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        seg->heads[i] = NULL;
+    }
+    for (size_t i = 0; i < SLAB_CLASSES; i++) {
+        seg->slabs[i] = NULL;
+    }
+    seg->tree_root = NULL;
+    for (size_t i = 0; i < QUICK_BINS; i++) {
+        seg->quick[i] = NULL;
+    }
+    seg->quick_count = 0;
+    seg->grow_size = chunksize;
+    seg->grow_clock = 0;
+    seg->zero_lo = (char *)arena_hi() + 1;
+    seg->zero_block = NULL;
+
+    // The word after the table is padding, so that payloads are aligned
+    tag_t *start = (tag_t *)(table + table_size + wsize);
+
     start[0] = pack(0, false, false, true); // Heap prologue (block footer)
     start[1] = pack(0, false, false, true); // Heap epilogue (block header)
 
@@ -1010,6 +2047,45 @@ bool mm_init(void) {
     return true;
 }
 
+// initializes a heap, invalidating every thread's cached blocks
+bool mm_init(void) {
+#if MM_STATS
+    stats = (mm_stats_t){0};
+#endif
+
+#if MM_ARENAS > 1
+    // memlib forgets its mapped regions when the heap is reset, so the other
+    // arenas start over with new ones
+    for (size_t i = 1; i < MM_ARENAS; i++) {
+        arenas[i].heap_start = arenas[i].heap_end = NULL;
+        arenas[i].seg = NULL;
+        arenas[i].lo = arenas[i].brk = arenas[i].fresh = NULL;
+    }
+    arena_enter(&arenas[0]);
+#else
+    heap_lock();
+#endif
+    bool ok = init_heap();
+#if MM_THREAD_CACHE
+    __atomic_add_fetch(&heap_gen, 1, __ATOMIC_RELEASE);
+#endif
+    heap_unlock();
+    return ok;
+}
+
+// moves the zero window past a block of size bytes that is being allocated,
+// and past the header and links of the free block that may follow it.
+// Returns where the block's payload bytes that were in the window begin
+static char *claim_zero(block_t *block, size_t size) {
+    char *payload = (char *)block + tsize;
+    char *zero_from = payload > seg->zero_lo ? payload : seg->zero_lo;
+    char *end = (char *)block + size + sizeof(tree_block_t);
+    if (end > seg->zero_lo) {
+        seg->zero_lo = end;
+    }
+    return zero_from;
+}
+
 // given a free block, splits the block if the block has
 // initially more space than is necessary for the allocated space
 static void split_block(block_t *block, size_t asize) {
@@ -1026,8 +2102,11 @@ static void split_block(block_t *block, size_t asize) {
     }
 
     if ((block_size - asize) >= min_block_size) {
+        count_split();
         pop(block);
         write_block(block, asize, get_prev_min(block), get_prev_alloc(block), true);
+        seg->zero_block = block;
+        seg->zero_from = claim_zero(block, asize);
         block_t *free_block = find_next(block);
 //        free_block->header |= prev_alloc_mask;
         //write_block(free_block, block_size - asize, get_prev_min(block), true, false);
@@ -1056,11 +2135,16 @@ static void split_block(block_t *block, size_t asize) {
     }
     pop(block);
     write_block(block, block_size, get_prev_min(block), get_prev_alloc(block), true);
-
-    block_t *block_next= find_next(block);
-    block_next->header |= prev_alloc_mask;
-    if(block_size == min_block_size)
-        block_next->header |= prev_min_mask;
+    seg->zero_block = block;
+    seg->zero_from = claim_zero(block, block_size);
+
+    // the epilogue must stay exactly 0x1, it carries no prev bits
+    if(!is_last_block){
+        block_t *block_next= find_next(block);
+        block_next->header |= prev_alloc_mask;
+        if(block_size == min_block_size)
+            block_next->header |= prev_min_mask;
+    }
 
     if(is_last_block) heap_end= block;
 
@@ -1068,83 +2152,607 @@ static void split_block(block_t *block, size_t asize) {
     dbg_ensures(mm_checkheap(__LINE__));
 }
 
-// memory allocation of a certain requested size, tries to find a fit, if none
-// found, requests more heap space
-void *malloc(size_t size) {
-    dbg_requires(mm_checkheap(__LINE__));
+// rounds a malloc request up to the size of the block that will hold it
+static size_t adjust_size(size_t size) {
+    if (size <= min_block_size - tsize) {
+        return min_block_size;
+    }
+    return round_up(size + tsize, dsize);
+}
 
-    size_t asize;      // Adjusted block size
-    size_t extendsize; // Amount to extend heap if no fit is found
-    block_t *block;
-    void *bp = NULL;
+// shrinks the free block at the end of the heap to chunksize bytes and
+// returns the rest of it to memlib
+static void trim_heap(void) {
+    block_t *block = heap_end;
+    size_t size = get_size(block);
+    dbg_requires(!get_alloc(block) && size > chunksize);
 
-    // Initialize heap if it isn't initialized
-    if (heap_start == NULL) {
-        mm_init();
+    pop(block);
+    write_block(block, chunksize, get_prev_min(block), get_prev_alloc(block), false);
+    push(block);
+
+    arena_sbrk(-(intptr_t)(size - chunksize));
+    write_epilogue(find_next(block));
+}
+
+// marks an allocated block free and coalesces it, trimming the heap if that
+// leaves a large free block at its end
+static void free_heap_block(block_t *block) {
+    size_t size = get_size(block);
+
+    // The block should be marked as allocated
+    dbg_assert(get_alloc(block));
+
+    write_block(block, size, get_prev_min(block), get_prev_alloc(block), false);
+    block_t *block_next= find_next(block);
+    block_next->header &= ~prev_alloc_mask;
+
+    block = coalesce_block(block);
+    if ((word_t)block == (word_t)heap_end && get_size(block) >= trim_threshold)
+        trim_heap();
+}
+
+// coalesces every quick-listed block into the free lists
+static void quick_flush(void) {
+    for (size_t i = 0; i < QUICK_BINS; i++) {
+        while (seg->quick[i] != NULL) {
+            min_block_t *block = seg->quick[i];
+            seg->quick[i] = block->val.next;
+            prefetch(block->val.next);
+            seg->quick_count--;
+            free_heap_block((block_t *)block);
+        }
     }
+}
 
-    // Ignore spurious request
-    if (size == 0) {
-        dbg_ensures(mm_checkheap(__LINE__));
-        return bp;
+// defers the coalescing of an allocated block by putting it on the quick
+// list of its size
+static void quick_put(block_t *block) {
+    min_block_t *quick_block = (min_block_t *)block;
+    size_t i = get_size(block) / dsize - 1;
+    quick_block->val.next = seg->quick[i];
+    seg->quick[i] = quick_block;
+
+    if (++seg->quick_count > quick_limit) {
+        quick_flush();
     }
+}
 
-    if(size <= wsize){
-        asize= min_block_size;
-    }else{
-        asize = round_up(size + wsize, dsize);
+// pops a quick-listed block of exactly asize bytes, or returns NULL
+static block_t *quick_get(size_t asize) {
+    size_t i = asize / dsize - 1;
+    min_block_t *block = seg->quick[i];
+    if (block != NULL) {
+        seg->quick[i] = block->val.next;
+        seg->quick_count--;
+    }
+    return (block_t *)block;
+}
+
+// returns how many bytes to extend the heap by for a request of asize bytes
+// that no free block can take, adapting the growth size to how recently the
+// heap last grew
+static size_t grow_heap_size(size_t asize) {
+    if (!MM_ADAPTIVE_GROWTH) {
+        return max(asize, chunksize);
+    }
+
+    if (seg->grow_clock <= grow_window) {
+        if (seg->grow_size < grow_max_size)
+            seg->grow_size *= 2;
+    } else if (seg->grow_size > chunksize) {
+        seg->grow_size /= 2;
     }
+    seg->grow_clock = 0;
+
+    size_t limit = max(arena_heapsize() / grow_headroom, chunksize);
+    size_t size = seg->grow_size < limit ? seg->grow_size : limit;
+    return max(asize, size);
+}
 
+// finds a free block of at least asize bytes, or extends the heap for
+// want bytes (at least asize) if none fits
+static block_t *find_heap_block(size_t asize, size_t want) {
+    size_t extendsize; // Amount to extend heap if no fit is found
+    block_t *block;
+
+    seg->grow_clock++;
     block = find_fit(asize);
 
-    // If no fit is found, request more memory, and then and place the block
+    // Coalescing the quick-listed blocks may make room without growing
+    if (MM_DEFER_COALESCE && block == NULL && seg->quick_count > 0) {
+        quick_flush();
+        block = find_fit(asize);
+    }
+
+    // If no fit is found, request more memory
     if (block == NULL) {
-        extendsize = max(asize, chunksize);
+        extendsize = grow_heap_size(want);
         block = extend_heap(extendsize);
-        if (block == NULL) {
-            return bp;
-        }
     }
 
     // The block should be marked as free
-    dbg_assert(!get_alloc(block));
+    dbg_assert(block == NULL || !get_alloc(block));
+    return block;
+}
 
-    // Try to split the block if too large and allocate space too
-    if(get_size(block) == min_block_size){
+// finds a fit for (or extends the heap by) asize bytes and allocates it
+static block_t *alloc_heap_block(size_t asize) {
+    block_t *block = find_heap_block(asize, asize);
+    if (block == NULL) {
+        return NULL;
     }
+
+    // Try to split the block if too large and allocate space too
     split_block(block, asize);
+    return block;
+}
+
+// links a slab at the head of its class's list of slabs with free slots
+static void slab_link(slab_t *slab) {
+    size_t i = slab->size / dsize - 1;
+    slab->prev = NULL;
+    slab->next = seg->slabs[i];
+    if (slab->next != NULL) {
+        slab->next->prev = slab;
+    }
+    seg->slabs[i] = slab;
+}
 
-    bp = header_to_payload(block);
+// unlinks a slab from its class's list of slabs with free slots
+static void slab_unlink(slab_t *slab) {
+    size_t i = slab->size / dsize - 1;
+    if (slab->prev != NULL) {
+        slab->prev->next = slab->next;
+    } else {
+        seg->slabs[i] = slab->next;
+    }
+    if (slab->next != NULL) {
+        slab->next->prev = slab->prev;
+    }
+}
+
+// carves a new slab of asize-byte slots out of an allocated heap block
+static slab_t *slab_create(size_t asize) {
+    size_t chunk_size = tsize + sizeof(slab_t) + slab_slots * asize;
+    block_t *chunk = alloc_heap_block(chunk_size);
+    if (chunk == NULL) {
+        return NULL;
+    }
+
+    slab_t *slab = (slab_t *)header_to_payload(chunk);
+    slab->size = (unsigned int)asize;
+    slab->nfree = (unsigned int)slab_slots;
+    slab->map = ~(word_t)0 >> (64 - slab_slots);
+    slab_link(slab);
+    return slab;
+}
+
+// takes the lowest free slot of a slab with asize-byte slots, creating a slab
+// if the class has none with free slots
+static block_t *slab_alloc(size_t asize) {
+    slab_t *slab = seg->slabs[asize / dsize - 1];
+    if (slab == NULL) {
+        slab = slab_create(asize);
+        if (slab == NULL) {
+            return NULL;
+        }
+    }
+    dbg_assert(slab->nfree > 0 && slab->map != 0);
+
+    size_t index = (size_t)__builtin_ctzl(slab->map);
+    slab->map &= slab->map - 1;
+    if (--slab->nfree == 0) {
+        slab_unlink(slab);
+    }
+
+    size_t offset = sizeof(slab_t) + index * asize;
+    block_t *slot = (block_t *)((char *)slab + offset);
+    slot->header = (tag_t)(offset << 16 | index << 4) | slot_mask;
+    return slot;
+}
+
+// returns a slot to its slab; a slab left empty is given back to the heap
+static void slab_free(block_t *slot) {
+    slab_t *slab = slot_to_slab(slot);
+    size_t index = (slot->header >> 4) & 0xFFF;
+    dbg_assert(!((slab->map >> index) & 1));
+
+    slab->map |= (word_t)1 << index;
+    if (slab->nfree++ == 0) {
+        slab_link(slab);
+    }
+
+    if (slab->nfree == slab_slots) {
+        slab_unlink(slab);
+        free_heap_block(payload_to_header(slab));
+    }
+}
+
+// allocates a block of asize bytes in a mapped region of its own. The region
+// starts with its size; the block follows, so that its payload is aligned,
+// and runs to the end of the region
+static block_t *map_block(size_t asize) {
+    size_t size = round_up(asize + dsize - tsize, mem_pagesize());
+    char *region = mem_map(size);
+    if (region == (void *)-1) {
+        return NULL;
+    }
+    *(word_t *)region = size;
+    block_t *block = (block_t *)(region + dsize - tsize);
+    block->header = pack(0, false, true, true);
+    return block;
+}
+
+// resizes a mapped block to asize bytes, possibly moving its pages but
+// never copying them. Returns NULL, leaving the block as it was, on failure
+static block_t *remap_block(block_t *block, size_t asize) {
+    word_t *old_region = block_to_region(block);
+    size_t old_size = *old_region;
+    size_t size = round_up(asize + dsize - tsize, mem_pagesize());
+    if (size == old_size) {
+        return block;
+    }
+    char *region = mem_remap(old_region, old_size, size);
+    if (region == (void *)-1) {
+        return NULL;
+    }
+    *(word_t *)region = size;
+    return (block_t *)(region + dsize - tsize);
+}
+
+// allocates a block or slot of asize bytes; caller holds the heap lock
+static block_t *alloc_block(size_t asize) {
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        init_heap();
+    }
+
+    if (asize >= map_threshold) {
+        return map_block(asize);
+    }
+
+    if (MM_DEFER_COALESCE && asize <= quick_max_size) {
+        block_t *block = quick_get(asize);
+        if (block != NULL) {
+            return block;
+        }
+    }
+
+    // Small requests go to a slab, unless every slab of their class is full
+    // and a free block can take them without growing the heap: holes left
+    // in the heap would otherwise never be reused by small requests
+    if (MM_SLAB && asize <= slab_max_size) {
+        if (seg->slabs[asize / dsize - 1] == NULL) {
+            block_t *block = find_fit(asize);
+            if (block != NULL) {
+                split_block(block, asize);
+                return block;
+            }
+        }
+        return slab_alloc(asize);
+    }
+    return alloc_heap_block(asize);
+}
+
+// frees a block or slot; caller holds the heap lock
+static void free_block(block_t *block) {
+    count_free(block);
+    if (is_slot(block)) {
+        slab_free(block);
+        return;
+    }
+    if (is_mapped(block)) {
+        word_t *region = block_to_region(block);
+        mem_unmap(region, *region);
+        return;
+    }
+    if (MM_DEFER_COALESCE && get_size(block) <= quick_max_size) {
+        quick_put(block);
+        return;
+    }
+    free_heap_block(block);
+}
+
+// gives the tail of an allocated block beyond asize bytes back to the heap
+static void shrink_block(block_t *block, size_t asize) {
+    size_t size = get_size(block);
+    dbg_requires(get_alloc(block) && size - asize >= min_block_size);
+    count_split();
+
+    write_block(block, asize, get_prev_min(block), get_prev_alloc(block), true);
+    block_t *rest = find_next(block);
+    write_block(rest, size - asize, asize == min_block_size, true, true);
+
+    block_t *rest_next = find_next(rest);
+    if (rest_next->header != (word_t)0x1) {
+        if (size - asize == min_block_size)
+            rest_next->header |= prev_min_mask;
+        else
+            rest_next->header &= ~prev_min_mask;
+    }
+    if ((word_t)block == (word_t)heap_end)
+        heap_end = rest;
+
+    free_heap_block(rest);
+}
+
+// resizes an allocated block to asize bytes without moving it, by splitting
+// off its tail, absorbing a free successor, or growing the heap when the
+// block is at its end. Returns false if the block would have to move; caller
+// holds the heap lock
+static bool resize_block(block_t *block, size_t asize) {
+    if (is_slot(block)) {
+        return asize <= get_block_size(block);
+    }
+
+    size_t size = get_size(block);
+    if (asize <= size) {
+        if (size - asize >= min_block_size)
+            shrink_block(block, asize);
+        return true;
+    }
+
+    block_t *next = find_next(block);
+    bool next_free = next->header != (word_t)0x1 && !get_alloc(next);
+
+    // At the end of the heap, sbrk whatever the successor cannot provide
+    if ((word_t)block == (word_t)heap_end ||
+        (next_free && (word_t)next == (word_t)heap_end)) {
+        size_t avail = size + (next_free ? get_size(next) : 0);
+        if (avail < asize) {
+            if (extend_heap(asize - avail) == NULL)
+                return false;
+            next = find_next(block);
+            next_free = true;
+        }
+    }
+
+    if (!next_free || size + get_size(next) < asize)
+        return false;
+
+    size_t total = size + get_size(next);
+    bool next_was_end = (word_t)next == (word_t)heap_end;
+    pop(next);
+
+    if (total - asize >= min_block_size) {
+        count_split();
+        write_block(block, asize, get_prev_min(block), get_prev_alloc(block), true);
+        claim_zero(block, asize);
+        block_t *rest = find_next(block);
+        write_block(rest, total - asize, false, true, false);
+        push(rest);
+
+        block_t *rest_next = find_next(rest);
+        if (rest_next->header != (word_t)0x1) {
+            if (total - asize == min_block_size)
+                rest_next->header |= prev_min_mask;
+            else
+                rest_next->header &= ~prev_min_mask;
+        }
+        if (next_was_end)
+            heap_end = rest;
+        return true;
+    }
+
+    write_block(block, total, get_prev_min(block), get_prev_alloc(block), true);
+    claim_zero(block, total);
+    block_t *block_next = find_next(block);
+    if (block_next->header != (word_t)0x1) {
+        block_next->header |= prev_alloc_mask;
+        block_next->header &= ~prev_min_mask;
+    }
+    if (next_was_end)
+        heap_end = block;
+    return true;
+}
+
+#if MM_THREAD_CACHE
+// frees every block cached by the calling thread back to the shared heap;
+// runs as the thread-exit destructor of tc_key
+static void tc_flush(void *arg) {
+    tcache_t *tc = (tcache_t *)arg;
+
+    heap_lock();
+    bool live = tc->gen == heap_gen;
+    for (size_t i = 0; i < TC_BINS; i++) {
+        void *bp = tc->bins[i];
+        while (live && bp != NULL) {
+            void *next = *(void **)bp;
+            heap_switch(payload_to_header(bp));
+            free_block(payload_to_header(bp));
+            bp = next;
+        }
+        tc->bins[i] = NULL;
+        tc->count[i] = 0;
+    }
+    heap_unlock();
+}
+
+static void tc_key_create(void) {
+    pthread_key_create(&tc_key, tc_flush);
+}
+
+// drops the calling thread's cache if it predates the last mm_init
+static tcache_t *tc_current(void) {
+    tcache_t *tc = &tcache;
+    unsigned long gen = __atomic_load_n(&heap_gen, __ATOMIC_ACQUIRE);
+    if (tc->gen != gen) {
+        for (size_t i = 0; i < TC_BINS; i++) {
+            tc->bins[i] = NULL;
+            tc->count[i] = 0;
+        }
+        tc->gen = gen;
+    }
+    return tc;
+}
+
+// pops a cached block of exactly asize bytes, or returns NULL on a miss
+static void *tc_get(size_t asize) {
+    if (asize > tc_max_size) {
+        return NULL;
+    }
+    tcache_t *tc = tc_current();
+    size_t i = asize / dsize - 1;
+    void *bp = tc->bins[i];
+    if (bp != NULL) {
+        tc->bins[i] = *(void **)bp;
+        tc->count[i]--;
+    }
+    return bp;
+}
+
+// caches a block of size bytes being freed; on overflow half of the bin is
+// returned to the shared heap under a single lock acquisition. Returns false
+// if the block is too large to be cached.
+static bool tc_put(block_t *block, size_t size) {
+    if (size > tc_max_size) {
+        return false;
+    }
+    tcache_t *tc = tc_current();
+    size_t i = size / dsize - 1;
+
+    if (!tc->registered) {
+        // Set first: pthread_setspecific may itself call malloc
+        tc->registered = true;
+        pthread_once(&tc_key_once, tc_key_create);
+        pthread_setspecific(tc_key, tc);
+    }
+
+    if (tc->count[i] >= tc_bin_cap) {
+        heap_lock();
+        while (tc->count[i] > tc_bin_cap / 2) {
+            void *bp = tc->bins[i];
+            tc->bins[i] = *(void **)bp;
+            tc->count[i]--;
+            heap_switch(payload_to_header(bp));
+            free_block(payload_to_header(bp));
+        }
+        heap_unlock();
+    }
+
+    void *bp = header_to_payload(block);
+    *(void **)bp = tc->bins[i];
+    tc->bins[i] = bp;
+    tc->count[i]++;
+    return true;
+}
+#endif
+
+// allocates a payload of size bytes, setting *zero_lo and *zero_hi to the
+// part of it that is known to hold zeros (an empty range at its end if none)
+static void *alloc_payload(size_t size, char **zero_lo, char **zero_hi) {
+    // Ignore spurious request
+    if (size == 0) {
+        return NULL;
+    }
+
+    size_t asize = adjust_size(size);
+
+#if MM_THREAD_CACHE
+    void *cached = tc_get(asize);
+    if (cached != NULL) {
+        *zero_lo = *zero_hi = (char *)cached + size;
+        return cached;
+    }
+#endif
+
+    heap_lock();
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (heap_start != NULL) {
+        seg->zero_block = NULL;
+    }
+    block_t *block = alloc_block(asize);
+    if (block == NULL && heap_spill()) {
+        if (heap_start != NULL) {
+            seg->zero_block = NULL;
+        }
+        block = alloc_block(asize);
+    }
+    char *bp = NULL;
+    if (block != NULL) {
+        count_alloc(block);
+        bp = header_to_payload(block);
+        char *end = bp + size;
+        *zero_lo = *zero_hi = end;
+
+        if (MM_FRESH_ZERO && is_mapped(block)) {
+            if (mem_fresh_lo() != NULL)
+                *zero_lo = bp;
+        } else if (MM_FRESH_ZERO && block == seg->zero_block) {
+            // The window ends before the last block's footer and the
+            // epilogue, and the size word of a huge free block
+            char *hi = (char *)arena_hi() + 1 - dsize;
+            *zero_hi = hi < end ? hi : end;
+            *zero_lo = seg->zero_from < *zero_hi ? seg->zero_from : *zero_hi;
+        }
+    }
 
     dbg_ensures(mm_checkheap(__LINE__));
+    heap_unlock();
     return bp;
 }
 
+// memory allocation of a certain requested size, tries to find a fit, if none
+// found, requests more heap space
+void *malloc(size_t size) {
+    char *zero_lo, *zero_hi;
+    return alloc_payload(size, &zero_lo, &zero_hi);
+}
+
 // frees a block designated by a pointer to the payload of the block
 void free(void *bp) {
+    if (bp == NULL) {
+        return;
+    }
+
+    block_t *block = payload_to_header(bp);
+
+#if MM_THREAD_CACHE
+    if (tc_put(block, get_block_size(block))) {
+        return;
+    }
+#endif
+
+    heap_lock_block(block);
     dbg_requires(mm_checkheap(__LINE__));
 
+    free_block(block);
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    heap_unlock();
+}
+
+// frees a block that was allocated (or last reallocated) with a request of
+// size bytes; the size picks the thread cache bin without decoding the tag,
+// which for a slot or a mapped block means a load from another cache line
+void free_sized(void *bp, size_t size) {
     if (bp == NULL) {
         return;
     }
 
     block_t *block = payload_to_header(bp);
-    size_t size = get_size(block);
+    dbg_assert(adjust_size(size) <= get_block_size(block));
 
-    // The block should be marked as allocated
-    dbg_assert(get_alloc(block));
+#if MM_THREAD_CACHE
+    if (tc_put(block, adjust_size(size))) {
+        return;
+    }
+#endif
 
-    write_block(block, size, get_prev_min(block), get_prev_alloc(block), false);
-    block_t *block_next= find_next(block);
-    block_next->header &= ~prev_alloc_mask;
+    heap_lock_block(block);
+    dbg_requires(mm_checkheap(__LINE__));
 
-    block = coalesce_block(block);
+    free_block(block);
 
     dbg_ensures(mm_checkheap(__LINE__));
+    heap_unlock();
 }
 
-// reallocates a block to adjust the size, using malloc and free functions
-// previously defined
+// reallocates a block to adjust the size, in place when the block can be
+// shrunk or grown where it is, by remapping a large mapped block, otherwise
+// using malloc and free
 void *realloc(void *ptr, size_t size) {
     block_t *block = payload_to_header(ptr);
     size_t copysize;
@@ -1161,6 +2769,27 @@ void *realloc(void *ptr, size_t size) {
         return malloc(size);
     }
 
+    size_t asize = adjust_size(size);
+
+    heap_lock_block(block);
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // A mapped block that stays large is remapped rather than copied
+    if (is_mapped(block) && asize >= map_threshold) {
+        block = remap_block(block, asize);
+        dbg_ensures(mm_checkheap(__LINE__));
+        heap_unlock();
+        return block == NULL ? NULL : header_to_payload(block);
+    }
+
+    bool resized = !is_mapped(block) && asize <= max_tag_size &&
+                   resize_block(block, asize);
+    dbg_ensures(mm_checkheap(__LINE__));
+    heap_unlock();
+    if (resized) {
+        return ptr;
+    }
+
     // Otherwise, proceed with reallocation
     newptr = malloc(size);
 
@@ -1196,17 +2825,300 @@ void *calloc(size_t elements, size_t size) {
         return NULL;
     }
 
-    bp = malloc(asize);
+    char *zero_lo, *zero_hi;
+    bp = alloc_payload(asize, &zero_lo, &zero_hi);
     if (bp == NULL) {
         return NULL;
     }
 
-    // Initialize all bits to 0
-    memset(bp, 0, asize);
+    // Initialize all bits to 0, except those known to be zero already
+    memset(bp, 0, (size_t)(zero_lo - (char *)bp));
+    memset(zero_hi, 0, (size_t)((char *)bp + asize - zero_hi));
 
     return bp;
 }
 
+// moves the payload of an allocated block up to the next multiple of
+// alignment, freeing the slack before it as a block of its own, and frees
+// whatever lies beyond asize bytes. Returns the aligned block
+static block_t *align_block(block_t *block, size_t alignment, size_t asize) {
+    size_t size = get_size(block);
+    word_t bp = (word_t)header_to_payload(block);
+    size_t lead = round_up(bp, alignment) - bp;
+
+    // Payloads are dsize-aligned, so any slack can hold a free block
+    dbg_assert(lead % dsize == 0 && size >= lead + asize);
+    if (lead > 0) {
+        count_split();
+        block_t *aligned = (block_t *)((char *)block + lead);
+        write_block(aligned, size - lead, lead == min_block_size, false, true);
+        write_block(block, lead, get_prev_min(block), get_prev_alloc(block), false);
+
+        block_t *next = find_next(aligned);
+        if (next->header != (word_t)0x1) {
+            if (size - lead == min_block_size)
+                next->header |= prev_min_mask;
+            else
+                next->header &= ~prev_min_mask;
+        }
+        if ((word_t)block == (word_t)heap_end)
+            heap_end = aligned;
+        coalesce_block(block);
+        block = aligned;
+        size -= lead;
+    }
+
+    if (size - asize >= min_block_size)
+        shrink_block(block, asize);
+    return block;
+}
+
+// allocates size bytes at a multiple of alignment, a power of two, from a
+// block with room for the payload at any offset; the slack on either side
+// of the payload goes back to the free lists instead of being wasted
+void *memalign(size_t alignment, size_t size) {
+    if (alignment == 0 || (alignment & (alignment - 1)) != 0) {
+        errno = EINVAL;
+        return NULL;
+    }
+    if (alignment <= dsize) {
+        return malloc(size);
+    }
+    if (size == 0 || size > max_tag_size || alignment > max_tag_size) {
+        return NULL;
+    }
+
+    size_t asize = adjust_size(size);
+    size_t rsize = asize + alignment - dsize;
+    if (rsize > max_tag_size) {
+        return NULL;
+    }
+
+    heap_lock();
+    dbg_requires(mm_checkheap(__LINE__));
+
+    // Initialize heap if it isn't initialized
+    if (heap_start == NULL) {
+        init_heap();
+    }
+
+    block_t *block = heap_start == NULL ? NULL : alloc_heap_block(rsize);
+    if (block == NULL && heap_spill()) {
+        if (heap_start == NULL) {
+            init_heap();
+        }
+        block = heap_start == NULL ? NULL : alloc_heap_block(rsize);
+    }
+    void *bp = NULL;
+    if (block != NULL) {
+        block = align_block(block, alignment, asize);
+        count_alloc(block);
+        bp = header_to_payload(block);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    heap_unlock();
+    return bp;
+}
+
+// allocates size bytes at a multiple of alignment, as memalign does
+void *aligned_alloc(size_t alignment, size_t size) {
+    return memalign(alignment, size);
+}
+
+#ifndef DRIVER
+// allocates size bytes at a multiple of alignment into *memptr, returning
+// EINVAL unless alignment is a power of two multiple of sizeof(void *)
+int posix_memalign(void **memptr, size_t alignment, size_t size) {
+    if (alignment % sizeof(void *) != 0 ||
+        (alignment & (alignment - 1)) != 0) {
+        return EINVAL;
+    }
+    void *bp = memalign(alignment, size);
+    if (bp == NULL && size != 0) {
+        return ENOMEM;
+    }
+    *memptr = bp;
+    return 0;
+}
+#endif
+
+// allocates up to n blocks of asize bytes back to back, as many as the fit
+// for one of them holds (or all n when the heap grows), so the search, the
+// split and the free-list updates happen once per run; caller holds the heap
+// lock. Returns how many were allocated, 0 if the heap is full
+static size_t alloc_run(size_t asize, size_t n, void **out) {
+    block_t *block = find_heap_block(asize, n * asize);
+    if (block == NULL) {
+        return 0;
+    }
+    if (get_size(block) / asize < n) {
+        n = get_size(block) / asize;
+    }
+    split_block(block, n * asize);
+
+    size_t size = get_size(block);
+    bool was_end = (word_t)block == (word_t)heap_end;
+    bool prev_min = get_prev_min(block);
+    bool prev_alloc = get_prev_alloc(block);
+    for (size_t i = 0; i < n; i++) {
+        // The last block keeps whatever the fit left over
+        size_t bsize = i + 1 < n ? asize : size - (n - 1) * asize;
+        if (i + 1 < n)
+            count_split();
+        write_block(block, bsize, prev_min, prev_alloc, true);
+        count_alloc(block);
+        out[i] = header_to_payload(block);
+        if (was_end && i + 1 == n)
+            heap_end = block;
+
+        prev_min = bsize == min_block_size;
+        prev_alloc = true;
+        block = find_next(block);
+    }
+
+    if (block->header != (word_t)0x1) {
+        if (prev_min)
+            block->header |= prev_min_mask;
+        else
+            block->header &= ~prev_min_mask;
+    }
+    return n;
+}
+
+// allocates n payloads of size bytes each into out, under one acquisition of
+// the heap lock. Heap-sized requests are carved out of a single fit per run
+// of up to batch_max_size bytes. Returns how many were allocated, fewer than
+// n only if the heap is full
+size_t malloc_batch(size_t size, size_t n, void **out) {
+    if (size == 0) {
+        return 0;
+    }
+
+    size_t asize = adjust_size(size);
+    size_t done = 0;
+
+#if MM_THREAD_CACHE
+    while (done < n && (out[done] = tc_get(asize)) != NULL) {
+        done++;
+    }
+#endif
+
+    heap_lock();
+    dbg_requires(mm_checkheap(__LINE__));
+
+    if (heap_start == NULL) {
+        init_heap();
+    }
+
+    // Slots and quick-listed blocks are already cheap to hand out one by
+    // one; so are blocks too large to share a run
+    bool runs = heap_start != NULL && asize <= batch_max_size / 2 &&
+                !(MM_SLAB && asize <= slab_max_size);
+    while (done < n) {
+        block_t *block = NULL;
+        if (MM_DEFER_COALESCE && asize <= quick_max_size && heap_start != NULL) {
+            block = quick_get(asize);
+        }
+
+        size_t k = n - done;
+        if (block == NULL && runs && k > 1) {
+            if (k > batch_max_size / asize)
+                k = batch_max_size / asize;
+            size_t got = alloc_run(asize, k, out + done);
+            if (got > 0) {
+                done += got;
+                continue;
+            }
+            runs = false;
+        }
+
+        if (block == NULL && (block = alloc_block(asize)) == NULL) {
+            // A full arena hands the rest of the batch to arena 0
+            if (!heap_spill())
+                break;
+            runs = false;
+            continue;
+        }
+        count_alloc(block);
+        out[done++] = header_to_payload(block);
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    heap_unlock();
+    return done;
+}
+
+// frees n payloads, skipping NULL pointers, under one acquisition of the heap
+// lock. The blocks go straight back to the heap, past the thread cache
+void free_batch(void **ptrs, size_t n) {
+    heap_lock();
+    dbg_requires(mm_checkheap(__LINE__));
+
+    for (size_t i = 0; i < n; i++) {
+        if (ptrs[i] != NULL) {
+            if (i + 1 < n)
+                prefetch(ptrs[i + 1]);
+            heap_switch(payload_to_header(ptrs[i]));
+            free_block(payload_to_header(ptrs[i]));
+        }
+    }
+
+    dbg_ensures(mm_checkheap(__LINE__));
+    heap_unlock();
+}
+
+// returns the smallest block size that get_index maps to class i
+static size_t class_min_size(size_t i) {
+    if (i < (1 << 6) / dsize)
+        return i * dsize;
+
+    size_t lg = i / SL_COUNT + 5;
+    return ((size_t)1 << lg) + (i % SL_COUNT) * ((size_t)1 << (lg - SL_BITS));
+}
+
+// writes the event counters to fp as one record per line
+void mm_stats_dump(FILE *fp) {
+#if MM_STATS
+    heap_lock();
+    mm_stats_t snap = stats;
+    size_t grow_size = seg == NULL ? 0 : seg->grow_size;
+    heap_unlock();
+
+    fprintf(fp, "# class min_size allocs frees\n");
+    for (size_t i = 0; i < NUM_CLASSES; i++) {
+        if (snap.allocs[i] != 0 || snap.frees[i] != 0) {
+            fprintf(fp, "class %zu %zu %" PRIu64 " %" PRIu64 "\n", i,
+                    class_min_size(i), snap.allocs[i], snap.frees[i]);
+        }
+    }
+    fprintf(fp, "mapped %zu %" PRIu64 " %" PRIu64 "\n", map_threshold,
+            snap.allocs[NUM_CLASSES], snap.frees[NUM_CLASSES]);
+    fprintf(fp, "split %" PRIu64 "\n", snap.splits);
+    for (int c = 0; c < 4; c++) {
+        fprintf(fp, "coalesce %d %" PRIu64 "\n", c + 1, snap.coalesces[c]);
+    }
+    fprintf(fp, "extend %" PRIu64 "\n", snap.extends);
+    fprintf(fp, "extend_bytes %" PRIu64 "\n", snap.extend_bytes);
+    fprintf(fp, "grow_size %zu\n", grow_size);
+
+    fprintf(fp, "# fit min_steps max_steps searches\n");
+    for (size_t bin = 0; bin < FIT_BINS; bin++) {
+        size_t lo = bin == 0 ? 0 : (size_t)1 << (bin - 1);
+        if (bin == FIT_BINS - 1) {
+            fprintf(fp, "fit %zu inf %" PRIu64 "\n", lo, snap.fit_hist[bin]);
+        } else {
+            size_t hi = bin == 0 ? 0 : ((size_t)1 << bin) - 1;
+            fprintf(fp, "fit %zu %zu %" PRIu64 "\n", lo, hi,
+                    snap.fit_hist[bin]);
+        }
+    }
+    fprintf(fp, "fit_steps %" PRIu64 "\n", snap.fit_steps);
+#else
+    fprintf(fp, "# statistics not compiled in (MM_STATS=0)\n");
+#endif
+}
+
 /*
  *****************************************************************************
  * Do not delete the following super-secret(tm) lines!                       *
@@ -13,6 +13,11 @@ extern void *mm_malloc(size_t size);
 extern void mm_free(void *ptr);
 extern void *mm_realloc(void *ptr, size_t size);
 extern void *mm_calloc(size_t nmemb, size_t size);
+extern void *mm_memalign(size_t alignment, size_t size);
+extern void *mm_aligned_alloc(size_t alignment, size_t size);
+extern void mm_free_sized(void *ptr, size_t size);
+extern size_t mm_malloc_batch(size_t size, size_t n, void **out);
+extern void mm_free_batch(void **ptrs, size_t n);
 
 #else
 
@@ -56,6 +61,69 @@ extern void *realloc(void *ptr, size_t size);
  * @return A pointer to the first element of the array.
  */
 extern void *calloc(size_t nmemb, size_t size);
+
+/**
+ * @brief  Allocate memory in the heap of at least `size` bytes, starting at
+ *         a multiple of `alignment`.
+ *
+ * @param[in] alignment  The alignment of the payload, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes, or NULL if
+ *          `alignment` is not a power of two.
+ */
+extern void *memalign(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory aligned to `alignment`, as memalign does.
+ *
+ * @param[in] alignment  The alignment of the payload, a power of two.
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  A pointer to the beginning of the allocated bytes.
+ */
+extern void *aligned_alloc(size_t alignment, size_t size);
+
+/**
+ * @brief  Allocate memory aligned to `alignment` and store it in `memptr`.
+ *
+ * @param[out] memptr  Where to store the pointer to the allocated bytes.
+ * @param[in] alignment  The alignment, a power of two multiple of
+ *                       sizeof(void *).
+ * @param[in] size  The minimum size of bytes to allocate.
+ *
+ * @return  0 on success, EINVAL for a bad alignment, or ENOMEM.
+ */
+extern int posix_memalign(void **memptr, size_t alignment, size_t size);
+
+/**
+ * @brief  Marks an allocated block of known size as free.
+ *
+ * @param[in] ptr A pointer to the beginning of the allocated payload.
+ * @param[in] size  The size passed to the call that allocated (or last
+ *                  reallocated) the block.
+ */
+extern void free_sized(void *ptr, size_t size);
+
+/**
+ * @brief  Allocate `n` blocks of at least `size` bytes each.
+ *
+ * @param[in] size  The minimum size of bytes of each block.
+ * @param[in] n  The number of blocks to allocate.
+ * @param[out] out  An array of `n` pointers, filled with the payloads.
+ *
+ * @return  The number of blocks allocated, less than `n` only if memory
+ *          ran out.
+ */
+extern size_t malloc_batch(size_t size, size_t n, void **out);
+
+/**
+ * @brief  Marks `n` allocated blocks as free.
+ *
+ * @param[in] ptrs  An array of `n` payload pointers, which may be NULL.
+ * @param[in] n  The number of pointers in `ptrs`.
+ */
+extern void free_batch(void **ptrs, size_t n);
 #endif
 
 /**
@@ -74,3 +142,16 @@ extern bool mm_init(void);
  * @return  True if the heap is consistent, False otherwise.
  */
 extern bool mm_checkheap(int line);
+
+/**
+ * @brief  Print the allocator's event counters.
+ *
+ * Writes allocations and frees per size class, splits, coalesces by case,
+ * heap extensions (count, bytes and the current growth size) and a
+ * histogram of fit-search lengths to `fp`, one whitespace-separated
+ * record per line. Lines starting with '#' are
+ * comments. The counters are reset by mm_init.
+ *
+ * @param[in] fp  The stream to write the report to.
+ */
+extern void mm_stats_dump(FILE *fp);
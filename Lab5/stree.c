@@ -8,7 +8,11 @@
 
 #include "stree.h"
 
-static void free_subtree(node_t *x, free_fun_t free_fun);
+static node_t *node_new(tree_t *tree);
+static void node_free(tree_t *tree, node_t *x);
+static node_t *build_subtree(tree_t *tree, const tkey_t *keys,
+                             void *const *records, size_t n, node_t *parent);
+static void free_subtree(tree_t *tree, node_t *x, free_fun_t free_fun);
 static void left_rotate(tree_t *tree, node_t *x);
 static void right_rotate(tree_t *tree, node_t *x);
 static void splay(tree_t *tree, node_t *x);
@@ -17,7 +21,36 @@ static node_t *subtree_minimum(node_t *u);
 static node_t *subtree_maximum(node_t *u);
 static void show_subtree(node_t *x, bool tree_mode);
 
+node_pool_t *pool_new()
+{
+    node_pool_t *pool = malloc(sizeof(node_pool_t));
+    if (!pool)
+    {
+        fprintf(stderr, "ERROR.  Couldn't create node pool\n");
+        exit(1);
+    }
+    pool->slabs = NULL;
+    pool->free_list = NULL;
+    return pool;
+}
+
+void pool_free(node_pool_t *pool)
+{
+    while (pool->slabs)
+    {
+        node_slab_t *s = pool->slabs;
+        pool->slabs = s->next;
+        free(s);
+    }
+    free(pool);
+}
+
 tree_t *tree_new()
+{
+    return tree_new_pool(NULL);
+}
+
+tree_t *tree_new_pool(node_pool_t *pool)
 {
     tree_t *tree = malloc(sizeof(tree_t));
     if (!tree)
@@ -28,13 +61,13 @@ tree_t *tree_new()
     tree->root = NULL;
     tree->node_count = 0;
     tree->comparison_count = 0;
+    tree->pool = pool;
     return tree;
 }
 
 void tree_free(tree_t *tree, free_fun_t free_fun)
 {
-    if (tree->root)
-        free_subtree(tree->root, free_fun);
+    free_subtree(tree, tree->root, free_fun);
     free(tree);
 }
 
@@ -57,12 +90,7 @@ bool tree_insert(tree_t *tree, tkey_t key, void *record)
             z = z->left;
     }
 
-    z = malloc(sizeof(node_t));
-    if (!z)
-    {
-        fprintf(stderr, "ERROR.  Couldn't create range tree node\n");
-        exit(1);
-    }
+    z = node_new(tree);
     z->key = key;
     z->record = record;
     z->parent = p;
@@ -78,6 +106,23 @@ bool tree_insert(tree_t *tree, tkey_t key, void *record)
     return true;
 }
 
+bool tree_build(tree_t *tree, const tkey_t *keys, void *const *records,
+                size_t n)
+{
+    size_t i;
+    if (tree->root)
+        return false;
+    for (i = 1; i < n; i++)
+    {
+        tree->comparison_count++;
+        if (keys[i - 1] >= keys[i])
+            return false;
+    }
+    tree->root = build_subtree(tree, keys, records, n, NULL);
+    tree->node_count = n;
+    return true;
+}
+
 void *tree_find(tree_t *tree, tkey_t key)
 {
     node_t *z = tree->root;
@@ -151,7 +196,7 @@ void *tree_remove(tree_t *tree, tkey_t key)
     }
     r = z->record;
     tree->node_count--;
-    free(z);
+    node_free(tree, z);
     return r;
 }
 
@@ -172,15 +217,94 @@ void tree_show(tree_t *tree, bool tree_mode)
 
 /*** Helper functions ***/
 
-static void free_subtree(node_t *x, free_fun_t free_fun)
+static node_t *node_new(tree_t *tree)
 {
+    node_pool_t *pool = tree->pool;
+    node_t *x;
+    if (!pool)
+        x = malloc(sizeof(node_t));
+    else
+    {
+        if (!pool->free_list)
+        {
+            node_slab_t *s = malloc(sizeof(node_slab_t));
+            if (s)
+            {
+                size_t i;
+                s->next = pool->slabs;
+                pool->slabs = s;
+                for (i = 0; i < NODE_SLAB; i++)
+                {
+                    s->nodes[i].parent = pool->free_list;
+                    pool->free_list = &s->nodes[i];
+                }
+            }
+        }
+        x = pool->free_list;
+        if (x)
+            pool->free_list = x->parent;
+    }
     if (!x)
+    {
+        fprintf(stderr, "ERROR.  Couldn't create range tree node\n");
+        exit(1);
+    }
+    return x;
+}
+
+static void node_free(tree_t *tree, node_t *x)
+{
+    node_pool_t *pool = tree->pool;
+    if (!pool)
+    {
+        free(x);
         return;
-    free_subtree(x->left, free_fun);
-    free_subtree(x->right, free_fun);
-    if (free_fun)
-        free_fun(x->record);
-    free(x);
+    }
+    x->parent = pool->free_list;
+    pool->free_list = x;
+}
+
+/* Build a balanced subtree from n sorted records, recursing log n deep */
+static node_t *build_subtree(tree_t *tree, const tkey_t *keys,
+                             void *const *records, size_t n, node_t *parent)
+{
+    if (n == 0)
+        return NULL;
+    size_t mid = n / 2;
+    node_t *x = node_new(tree);
+    x->key = keys[mid];
+    x->record = records[mid];
+    x->parent = parent;
+    x->left = build_subtree(tree, keys, records, mid, x);
+    x->right = build_subtree(tree, keys + mid + 1, records + mid + 1,
+                             n - mid - 1, x);
+    return x;
+}
+
+/*
+ * Free nodes without recursion, by rotating each left child up until the
+ * node in hand has none, and then moving on to its right child
+ */
+static void free_subtree(tree_t *tree, node_t *x, free_fun_t free_fun)
+{
+    while (x)
+    {
+        node_t *y = x->left;
+        if (y)
+        {
+            x->left = y->right;
+            y->right = x;
+            x = y;
+        }
+        else
+        {
+            y = x->right;
+            if (free_fun)
+                free_fun(x->record);
+            node_free(tree, x);
+            x = y;
+        }
+    }
 }
 
 static void left_rotate(tree_t *tree, node_t *x)
@@ -20,20 +20,50 @@ typedef struct node {
     void *record; // Points to user data
 } node_t;
 
+/* Nodes are allocated NODE_SLAB at a time by a node pool */
+#define NODE_SLAB 256
+
+typedef struct node_slab {
+    struct node_slab *next;
+    node_t nodes[NODE_SLAB];
+} node_slab_t;
+
+typedef struct {
+    node_slab_t *slabs;
+    node_t *free_list; // Linked through the parent field
+} node_pool_t;
+
 typedef struct {
     node_t *root;
     size_t node_count;
     size_t comparison_count;
+    node_pool_t *pool; // NULL to malloc each node
 } tree_t;
 
+/* Node pools can be shared by several trees, and outlive them */
+node_pool_t *pool_new();
+
+/* Free pool and every node in it, whether or not still in a tree */
+void pool_free(node_pool_t *pool);
+
 tree_t *tree_new();
 
+/* Create tree whose nodes come from pool */
+tree_t *tree_new_pool(node_pool_t *pool);
+
 /* Delete all nodes in tree, applying free_fun to each record */
 void tree_free(tree_t *tree, free_fun_t free_fun);
 
 /* Insertion function returns false if already have key in tree */
 bool tree_insert(tree_t *tree, tkey_t key, void *record);
 
+/*
+ * Fill an empty tree with n records in linear time, balanced.  Returns
+ * false if tree is not empty or keys are not in strictly increasing order.
+ */
+bool tree_build(tree_t *tree, const tkey_t *keys, void *const *records,
+                size_t n);
+
 void *tree_find(tree_t *tree, tkey_t key);
 
 /* Find element with largest key <= given key */